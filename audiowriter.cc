@@ -0,0 +1,112 @@
+// Copyright 2021 David Guillen Fandos <david@davidgf.net>
+// Released under the GPL2 license
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include "audiowriter.h"
+#include "util.h"
+
+typedef struct {
+	uint8_t *buffer;
+	size_t mask;
+	// Monotonic positions, each one is only written by one of the threads
+	alignas(64) std::atomic<size_t> head;   // Producer (emulator thread)
+	alignas(64) std::atomic<size_t> tail;   // Consumer (writer thread)
+	std::atomic<bool> quit;
+	std::thread writer;
+	int fd;
+	audio_writer_stats_t stats;
+} audio_ring_t;
+
+// Heap allocated on purpose: it's never destroyed if we exit() abruptly
+static audio_ring_t *ring = NULL;
+
+// How long a thread sleeps when the ring is empty (writer) or full (emulator)
+static const auto poll_interval = std::chrono::microseconds(500);
+
+static void writer_thread() {
+	while (true) {
+		size_t tail = ring->tail.load(std::memory_order_relaxed);
+		size_t head = ring->head.load(std::memory_order_acquire);
+		if (head == tail) {
+			if (ring->quit.load(std::memory_order_acquire) &&
+			    ring->head.load(std::memory_order_acquire) == tail)
+				break;
+			std::this_thread::sleep_for(poll_interval);
+			continue;
+		}
+
+		// Write the contiguous chunk (up to the end of the buffer)
+		size_t offset = tail & ring->mask;
+		size_t chunk = std::min(head - tail, ring->mask + 1 - offset);
+		if (!ring->stats.failed && !write_all(ring->fd, &ring->buffer[offset], chunk))
+			ring->stats.failed = true;   // Keep draining so that the producer never blocks
+		ring->tail.store(tail + chunk, std::memory_order_release);
+	}
+}
+
+void audio_writer_start(int fd, size_t capacity) {
+	size_t cap = 4096;
+	while (cap < capacity)
+		cap <<= 1;
+
+	ring = new audio_ring_t();
+	ring->buffer = (uint8_t*)malloc(cap);
+	ring->mask = cap - 1;
+	ring->head = 0;
+	ring->tail = 0;
+	ring->quit = false;
+	ring->fd = fd;
+	ring->stats = {0};
+	ring->stats.capacity = cap;
+	ring->writer = std::thread(writer_thread);
+}
+
+void audio_writer_push(const void *data, size_t size) {
+	const uint8_t *src = (const uint8_t*)data;
+	size_t head = ring->head.load(std::memory_order_relaxed);
+	bool blocked = false;
+	auto start = std::chrono::steady_clock::now();
+
+	while (size) {
+		size_t used = head - ring->tail.load(std::memory_order_acquire);
+		size_t avail = ring->mask + 1 - used;
+		if (!avail) {
+			blocked = true;
+			std::this_thread::sleep_for(poll_interval);
+			continue;
+		}
+
+		size_t offset = head & ring->mask;
+		size_t chunk = std::min(std::min(size, avail), ring->mask + 1 - offset);
+		memcpy(&ring->buffer[offset], src, chunk);
+		head += chunk;
+		src += chunk;
+		size -= chunk;
+		ring->head.store(head, std::memory_order_release);
+		ring->stats.max_fill = std::max(ring->stats.max_fill, used + chunk);
+	}
+
+	if (blocked) {
+		auto end = std::chrono::steady_clock::now();
+		ring->stats.blocked++;
+		ring->stats.blocked_ns += std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count();
+	}
+}
+
+void audio_writer_stop() {
+	ring->quit.store(true, std::memory_order_release);
+	ring->writer.join();
+	free(ring->buffer);
+	ring->buffer = NULL;
+}
+
+audio_writer_stats_t audio_writer_stats() {
+	return ring->stats;
+}
+
@@ -0,0 +1,33 @@
+// Copyright 2021 David Guillen Fandos <david@davidgf.net>
+// Released under the GPL2 license
+
+#ifndef _AUDIOWRITER_H__
+#define _AUDIOWRITER_H__
+
+#include <stddef.h>
+
+// Audio dumping thread. The emulator thread pushes samples into a lock-free
+// single-producer/single-consumer ring and a dedicated thread writes them to
+// the ffmpeg pipe, so a slow encoder does not stall the core (unless the
+// ring fills up, which is accounted as backpressure).
+
+typedef struct {
+	unsigned long blocked;      // Pushes that found the ring full
+	unsigned long blocked_ns;   // Time the emulator thread spent waiting
+	size_t max_fill;            // Ring high-water mark (bytes)
+	size_t capacity;            // Ring size (bytes)
+	bool failed;                // Writing to the fd failed (data was discarded)
+} audio_writer_stats_t;
+
+// Starts the writer thread, the capacity is rounded up to a power of two.
+void audio_writer_start(int fd, size_t capacity);
+
+// Queues data to be written, waits if there's not enough room in the ring.
+void audio_writer_push(const void *data, size_t size);
+
+// Writes any pending data and stops the thread.
+void audio_writer_stop();
+
+audio_writer_stats_t audio_writer_stats();
+
+#endif
@@ -0,0 +1,253 @@
+// Copyright 2021 David Guillen Fandos <david@davidgf.net>
+// Released under the GPL2 license
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <signal.h>
+#include <unistd.h>
+#include <zlib.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include <iostream>
+#include <fstream>
+#include <chrono>
+#include <algorithm>
+#include "batch.h"
+#include "logger.h"
+#include "util.h"
+
+#define ROM_HASH_PREFIX   (32 * 1024 * 1024)
+
+typedef struct {
+	std::string rom, id, dir;
+	pid_t pid;
+	bool timedout;
+	std::chrono::steady_clock::time_point start;
+} batch_job_t;
+
+static void walk(const std::string &path, std::vector<std::string> *out) {
+	DIR *d = opendir(path.c_str());
+	if (!d)
+		return;
+	while (struct dirent *e = readdir(d)) {
+		if (e->d_name[0] == '.')
+			continue;
+		std::string fn = path + "/" + e->d_name;
+		struct stat st;
+		if (stat(fn.c_str(), &st))
+			continue;
+		if (S_ISDIR(st.st_mode))
+			walk(fn, out);
+		else
+			out->push_back(fn);
+	}
+	closedir(d);
+}
+
+static void add_path(const std::string &path, std::vector<std::string> *out) {
+	char *rp = realpath(path.c_str(), NULL);
+	if (!rp) {
+		std::cerr << "Skipping missing ROM " << path << std::endl;
+		return;
+	}
+	struct stat st;
+	if (!stat(rp, &st) && S_ISDIR(st.st_mode))
+		walk(rp, out);
+	else
+		out->push_back(rp);
+	free(rp);
+}
+
+std::vector<std::string> batch_roms(const std::string &list) {
+	std::vector<std::string> ret;
+	struct stat st;
+	if (!stat(list.c_str(), &st) && S_ISDIR(st.st_mode))
+		add_path(list, &ret);
+	else {
+		std::ifstream ifd(list);
+		std::string l;
+		while (std::getline(ifd, l))
+			if (!l.empty() && l[0] != '#')
+				add_path(l, &ret);
+	}
+	std::sort(ret.begin(), ret.end());
+	return ret;
+}
+
+// First 12 hex digits of the SHA-1 of the first 32MiB, as regression.py does
+static std::string rom_id(const std::string &rom, std::vector<uint8_t> *buf) {
+	int fd = open(rom.c_str(), O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return "";
+	buf->resize(ROM_HASH_PREFIX);
+	size_t size = 0;
+	while (size < buf->size()) {
+		ssize_t r = read(fd, buf->data() + size, buf->size() - size);
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r <= 0)
+			break;
+		size += r;
+	}
+	close(fd);
+
+	uint8_t digest[20];
+	sha1(buf->data(), size, digest);
+	char hex[13];
+	for (unsigned i = 0; i < 6; i++)
+		sprintf(&hex[i*2], "%02x", digest[i]);
+	return hex;
+}
+
+static std::string json_str(const std::string &s) {
+	std::string ret = "\"";
+	for (unsigned char c : s) {
+		if (c == '"' || c == '\\')
+			ret += std::string("\\") + (char)c;
+		else if (c < 0x20) {
+			char tmp[8];
+			sprintf(tmp, "\\u%04x", c);
+			ret += tmp;
+		}
+		else
+			ret += c;
+	}
+	return ret + "\"";
+}
+
+// Replaces "fn" with "fn.gz" (same as "gzip -5")
+static void gzip_file(const std::string &fn) {
+	int fd = open(fn.c_str(), O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return;
+	gzFile gz = gzopen((fn + ".gz").c_str(), "wb5");
+	if (gz) {
+		char buf[64*1024];
+		ssize_t r;
+		while ((r = read(fd, buf, sizeof(buf))) > 0)
+			gzwrite(gz, buf, r);
+		gzclose(gz);
+		unlink(fn.c_str());
+	}
+	close(fd);
+}
+
+// Runs in the freshly forked worker
+static void setup_worker(const batch_job_t &j, const batch_opts_t &opts) {
+	if (chdir(j.dir.c_str()))
+		_exit(126);
+	int fdo = open("stdout", O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	int fde = open("stderr", O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fdo < 0 || fde < 0)
+		_exit(126);
+	dup2(fdo, STDOUT_FILENO);
+	dup2(fde, STDERR_FILENO);
+	close(fdo);
+	close(fde);
+
+	if (nice(10) < 0)
+		std::cerr << "Could not lower the worker priority" << std::endl;
+	struct rlimit rl = {0, 0};
+	setrlimit(RLIMIT_CORE, &rl);
+	if (opts.memlimit) {
+		rl.rlim_cur = rl.rlim_max = (rlim_t)opts.memlimit << 20;
+		setrlimit(RLIMIT_AS, &rl);
+	}
+}
+
+bool batch_run(const std::vector<std::string> &roms, const std::string &outdir,
+               const batch_opts_t &opts, std::string *rom) {
+	mkdir(outdir.c_str(), 0755);
+	std::cout << "Running " << roms.size() << " ROMs, " << opts.jobs << " at a time" << std::endl;
+
+	auto batch_start = std::chrono::steady_clock::now();
+	std::vector<uint8_t> hashbuf;
+	std::vector<batch_job_t> running;
+	std::vector<std::string> done;
+	unsigned next = 0, failed = 0, timedout = 0;
+	while (next < roms.size() || !running.empty()) {
+		// Hand out ROMs as soon as a worker finishes, so that long runs
+		// don't hold back the rest of the batch.
+		while (next < roms.size() && running.size() < opts.jobs) {
+			batch_job_t j;
+			j.rom = roms[next++];
+			j.id = rom_id(j.rom, &hashbuf);
+			j.dir = outdir + "/" + j.id;
+			j.timedout = false;
+			if (j.id.empty() || mkdir(j.dir.c_str(), 0755)) {
+				std::cerr << "Skipping " << j.rom << (j.id.empty() ? " (unreadable)" : " (duplicate)") << std::endl;
+				continue;
+			}
+
+			std::cout << std::flush;
+			fflush(NULL);
+			log_fork_prepare();
+			j.start = std::chrono::steady_clock::now();
+			j.pid = fork();
+			if (!j.pid) {
+				setup_worker(j, opts);
+				*rom = j.rom;
+				return true;
+			}
+			if (j.pid < 0) {
+				std::cerr << "Could not fork a worker for " << j.rom << std::endl;
+				continue;
+			}
+			running.push_back(j);
+		}
+
+		int status;
+		pid_t pid = waitpid(-1, &status, WNOHANG);
+		if (pid <= 0) {
+			auto now = std::chrono::steady_clock::now();
+			for (auto &j : running) {
+				if (opts.timeout && !j.timedout && now - j.start > std::chrono::seconds(opts.timeout)) {
+					kill(j.pid, SIGKILL);
+					j.timedout = true;
+				}
+			}
+			usleep(10000);
+			continue;
+		}
+
+		auto it = std::find_if(running.begin(), running.end(), [pid] (const batch_job_t &j) { return j.pid == pid; });
+		if (it == running.end())
+			continue;
+		double runtime = std::chrono::duration<double>(std::chrono::steady_clock::now() - it->start).count();
+		int exitcode = WIFEXITED(status) ? WEXITSTATUS(status) : -WTERMSIG(status);
+		failed += exitcode ? 1 : 0;
+		timedout += it->timedout ? 1 : 0;
+
+		gzip_file(it->dir + "/stdout");
+		gzip_file(it->dir + "/stderr");
+		std::ofstream rfd(it->dir + "/results.json");
+		rfd << "{\"runtime\": " << runtime << ", \"exitcode\": " << exitcode
+		    << ", \"rom\": " << json_str(it->rom.substr(it->rom.rfind('/') + 1))
+		    << ", \"timeout\": " << (it->timedout ? "true" : "false") << "}";
+		rfd.close();
+
+		// Rewritten every time, so that partial results can be inspected
+		done.push_back(it->id);
+		std::ofstream lfd(outdir + "/results.json");
+		lfd << "[";
+		for (unsigned i = 0; i < done.size(); i++)
+			lfd << (i ? ", " : "") << json_str(done[i]);
+		lfd << "]";
+		lfd.close();
+
+		std::cout << "[" << done.size() << "/" << roms.size() << "] " << it->id << " " << it->rom
+		          << (it->timedout ? " timed out" : exitcode ? " failed" : "")
+		          << " (" << runtime << " s)" << std::endl;
+		running.erase(it);
+	}
+
+	double total = std::chrono::duration<double>(std::chrono::steady_clock::now() - batch_start).count();
+	std::cout << "Batch done: " << done.size() << " ROMs in " << total << " s, " << failed
+	          << " failed (" << timedout << " timed out)" << std::endl;
+	return false;
+}
@@ -0,0 +1,32 @@
+// Copyright 2021 David Guillen Fandos <david@davidgf.net>
+// Released under the GPL2 license
+
+#ifndef _BATCH_H__
+#define _BATCH_H__
+
+#include <string>
+#include <vector>
+
+// Batch mode: runs many ROMs with a single core load. The parent (with the
+// core already initialized) forks one worker per ROM, keeping "jobs" of them
+// running at a time. Every ROM gets a directory named after the SHA-1 of its
+// first 32MiB (like regression.py does) with stdout.gz, stderr.gz and a
+// results.json, and the top level results.json lists all of them.
+
+typedef struct {
+	unsigned jobs;
+	unsigned timeout;         // Wall clock limit per ROM in seconds (0 = none)
+	unsigned long memlimit;   // Address space limit per worker in MiB (0 = none)
+} batch_opts_t;
+
+// Expands a ROM list: either a directory (walked recursively) or a text file
+// with one path (file or directory) per line. Returns absolute paths.
+std::vector<std::string> batch_roms(const std::string &list);
+
+// Works like fork(): returns true in a worker, with "rom" set and the working
+// directory changed to its output directory (stdout/stderr point there too).
+// The parent returns false once all the ROMs are done.
+bool batch_run(const std::vector<std::string> &roms, const std::string &outdir,
+               const batch_opts_t &opts, std::string *rom);
+
+#endif
@@ -0,0 +1,325 @@
+// Copyright 2021 David Guillen Fandos <david@davidgf.net>
+// Released under the GPL2 license
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <ctype.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <zlib.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <iostream>
+#include <vector>
+#include "content.h"
+#include "util.h"
+
+typedef struct {
+	std::string ext;
+	bool need_fullpath;
+} content_override_t;
+
+static std::vector<content_override_t> overrides;
+
+static std::string lowercase(std::string s) {
+	for (auto &c : s)
+		c = tolower(c);
+	return s;
+}
+
+static std::string extension(const std::string &path) {
+	auto slash = path.rfind('/'), dot = path.rfind('.');
+	if (dot == std::string::npos || (slash != std::string::npos && dot < slash))
+		return "";
+	return lowercase(path.substr(dot + 1));
+}
+
+void content_set_overrides(const struct retro_system_content_info_override *ovr) {
+	for (; ovr->extensions; ovr++) {
+		const char *e = ovr->extensions;
+		while (*e) {
+			size_t l = strcspn(e, "|");
+			overrides.push_back({lowercase(std::string(e, l)), ovr->need_fullpath});
+			e += e[l] ? l + 1 : l;
+		}
+	}
+}
+
+static bool content_need_fullpath(const std::string &ext, bool need_fullpath) {
+	for (const auto &o : overrides)
+		if (o.ext == ext)
+			return o.need_fullpath;
+	return need_fullpath;
+}
+
+static void *map_file(int fd, size_t size, bool populate) {
+	// Writable but private: cores that patch the ROM in place get
+	// their own copy of the touched pages only.
+	void *m = mmap(NULL, size, PROT_READ | PROT_WRITE,
+	               MAP_PRIVATE | (populate ? MAP_POPULATE : 0), fd, 0);
+	return m == MAP_FAILED ? NULL : m;
+}
+
+static inline uint32_t rd16(const uint8_t *p) { return p[0] | (p[1] << 8); }
+static inline uint32_t rd32(const uint8_t *p) { return rd16(p) | (rd16(&p[2]) << 16); }
+
+typedef struct {
+	std::string name;
+	unsigned method;
+	const uint8_t *data;      // Compressed data
+	size_t csize, usize;
+} zip_entry_t;
+
+// Finds an entry (or the first file if "name" is empty) in a zip archive
+static bool zip_find(const uint8_t *zip, size_t size, const std::string &name, zip_entry_t *e) {
+	// The end of central directory record is followed by a comment (up to 64KiB)
+	if (size < 22)
+		return false;
+	size_t eocd = size - 22, lowest = size > 22 + 65535 ? size - 22 - 65535 : 0;
+	while (rd32(&zip[eocd]) != 0x06054b50) {
+		if (eocd == lowest)
+			return false;
+		eocd--;
+	}
+
+	unsigned count = rd16(&zip[eocd + 10]);
+	size_t off = rd32(&zip[eocd + 16]);
+	for (unsigned i = 0; i < count; i++) {
+		if (off + 46 > size || rd32(&zip[off]) != 0x02014b50)
+			return false;
+		unsigned flags = rd16(&zip[off + 8]);
+		unsigned nlen = rd16(&zip[off + 28]), xlen = rd16(&zip[off + 30]), clen = rd16(&zip[off + 32]);
+		size_t loff = rd32(&zip[off + 42]);
+		if (off + 46 + nlen > size)
+			return false;
+		std::string ename((const char*)&zip[off + 46], nlen);
+		bool isdir = !ename.empty() && ename.back() == '/';
+
+		if (!isdir && (name.empty() || name == ename)) {
+			if (flags & 1) {
+				std::cerr << "Encrypted zip entries are not supported" << std::endl;
+				return false;
+			}
+			if (loff + 30 > size || rd32(&zip[loff]) != 0x04034b50)
+				return false;
+			size_t doff = loff + 30 + rd16(&zip[loff + 26]) + rd16(&zip[loff + 28]);
+			e->name = ename;
+			e->method = rd16(&zip[off + 10]);
+			e->csize = rd32(&zip[off + 20]);
+			e->usize = rd32(&zip[off + 24]);
+			e->data = &zip[doff];
+			return doff + e->csize <= size;
+		}
+		off += 46 + nlen + xlen + clen;
+	}
+	return false;
+}
+
+// Streams the inflated data into the fd (raw deflate or gzip streams)
+static bool inflate_to_fd(const uint8_t *data, size_t size, bool gzip, int fd) {
+	z_stream strm;
+	memset(&strm, 0, sizeof(strm));
+	if (inflateInit2(&strm, gzip ? 16 + MAX_WBITS : -MAX_WBITS) != Z_OK)
+		return false;
+
+	std::vector<uint8_t> buf(1 << 20);
+	strm.next_in = (Bytef*)data;
+	int ret;
+	do {
+		// avail_in is 32 bit, feed huge inputs in chunks
+		if (!strm.avail_in && size) {
+			strm.avail_in = std::min(size, (size_t)1 << 30);
+			size -= strm.avail_in;
+		}
+		// Keep inflating even without input left, there might be output pending
+		strm.next_out = buf.data();
+		strm.avail_out = buf.size();
+		ret = inflate(&strm, Z_NO_FLUSH);
+		if (ret == Z_BUF_ERROR && !strm.avail_in && !size)
+			break;    // Truncated stream
+		if (ret != Z_OK && ret != Z_STREAM_END && ret != Z_BUF_ERROR)
+			break;
+		if (!write_all(fd, buf.data(), buf.size() - strm.avail_out)) {
+			ret = Z_ERRNO;
+			break;
+		}
+		// Concatenated gzip members are valid gzip files
+		if (ret == Z_STREAM_END && gzip && (size || strm.avail_in)) {
+			inflateReset(&strm);
+			ret = Z_OK;
+		}
+	} while (ret != Z_STREAM_END);
+	inflateEnd(&strm);
+	return ret == Z_STREAM_END;
+}
+
+// Whether the core takes this archive as is (like arcade cores and romsets)
+static bool core_takes_archive(const std::string &path, const struct retro_system_info *sysinfo) {
+	if (sysinfo->block_extract)
+		return true;
+	std::string ext = extension(path);
+	const char *e = sysinfo->valid_extensions;
+	while (e && *e) {
+		size_t l = strcspn(e, "|");
+		if (lowercase(std::string(e, l)) == ext)
+			return true;
+		e += e[l] ? l + 1 : l;
+	}
+	return false;
+}
+
+bool content_open(content_t *c, const std::string &path, const struct retro_system_info *sysinfo, bool populate) {
+	bool need_fullpath = sysinfo->need_fullpath;
+	c->data = c->map = c->dmap = NULL;
+	c->size = c->mapsize = c->dmapsize = 0;
+	c->memfd = -1;
+
+	// "file.zip#entry" selects an archive entry
+	std::string fpath = path, entry;
+	auto hash = path.rfind('#');
+	if (access(path.c_str(), F_OK) && hash != std::string::npos) {
+		fpath = path.substr(0, hash);
+		entry = path.substr(hash + 1);
+	}
+
+	char *rp = realpath(fpath.c_str(), NULL);
+	if (!rp)
+		return false;
+	c->path = rp;
+	free(rp);
+
+	int fd = open(c->path.c_str(), O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return false;
+	struct stat st;
+	uint8_t magic[4] = {0};
+	if (fstat(fd, &st) < 0 || pread(fd, magic, sizeof(magic), 0) < 0) {
+		close(fd);
+		return false;
+	}
+	bool isgz = magic[0] == 0x1f && magic[1] == 0x8b && magic[2] == 8;
+	bool iszip = rd32(magic) == 0x04034b50;
+	if ((isgz || iszip) && entry.empty() && core_takes_archive(c->path, sysinfo))
+		isgz = iszip = false;
+
+	if (!isgz && !iszip) {
+		if (!content_need_fullpath(extension(c->path), need_fullpath) && st.st_size) {
+			c->map = map_file(fd, st.st_size, populate);
+			c->mapsize = st.st_size;
+			c->data = c->map;
+			c->size = st.st_size;
+			if (!c->map) {
+				close(fd);
+				return false;
+			}
+		}
+		close(fd);
+	}
+	else {
+		// Compressed content, inflate it into a memfd
+		c->map = map_file(fd, st.st_size, false);
+		c->mapsize = st.st_size;
+		close(fd);
+		if (!c->map)
+			return false;
+
+		const uint8_t *cdata = (const uint8_t*)c->map;
+		size_t csize = st.st_size;
+		zip_entry_t ze = {"", 8, cdata, csize, 0};
+		if (iszip && !zip_find(cdata, csize, entry, &ze)) {
+			std::cerr << "Could not find the content in the zip archive" << std::endl;
+			content_close(c);
+			return false;
+		}
+		if (iszip && ze.method != 0 && ze.method != 8) {
+			std::cerr << "Unsupported zip compression method " << ze.method << std::endl;
+			content_close(c);
+			return false;
+		}
+
+		c->archive_path = c->path;
+		c->archive_file = isgz ? c->path.substr(c->path.rfind('/') + 1) : ze.name;
+		if (isgz && extension(c->archive_file) == "gz")
+			c->archive_file.resize(c->archive_file.size() - 3);
+		bool fullpath = content_need_fullpath(extension(c->archive_file), need_fullpath);
+
+		if (iszip && ze.method == 0 && !fullpath) {
+			// Stored entries can be used straight from the archive mapping
+			c->data = (void*)ze.data;
+			c->size = ze.csize;
+		}
+		else {
+			std::string mname = c->archive_file.substr(c->archive_file.rfind('/') + 1);
+			c->memfd = memfd_create(mname.c_str(), MFD_CLOEXEC);
+			bool ok = c->memfd >= 0;
+			if (ok && ze.method == 0)
+				ok = write_all(c->memfd, ze.data, ze.csize);
+			else if (ok)
+				ok = inflate_to_fd(ze.data, ze.csize, isgz, c->memfd);
+			if (!ok) {
+				std::cerr << "Failed to decompress " << c->path << std::endl;
+				content_close(c);
+				return false;
+			}
+			c->path = "/proc/self/fd/" + std::to_string(c->memfd);
+
+			// The compressed file is no longer needed
+			munmap(c->map, c->mapsize);
+			c->map = NULL;
+			c->mapsize = 0;
+
+			off_t usize = lseek(c->memfd, 0, SEEK_END);
+			if (!fullpath && usize > 0) {
+				c->dmap = map_file(c->memfd, usize, populate);
+				c->dmapsize = usize;
+				c->data = c->dmap;
+				c->size = usize;
+				if (!c->dmap) {
+					content_close(c);
+					return false;
+				}
+			}
+		}
+	}
+
+	// Names refer to the real file (the one inside the archive if any)
+	std::string rpath = c->archive_path.empty() ? c->path : c->archive_path;
+	std::string fname = c->archive_path.empty() ? rpath : c->archive_file;
+	c->dir = rpath.substr(0, rpath.rfind('/'));
+	c->name = fname.substr(fname.rfind('/') + 1);
+	c->ext = extension(c->name);
+	if (!c->ext.empty())
+		c->name.resize(c->name.size() - c->ext.size() - 1);
+
+	c->info.path = c->path.c_str();
+	c->info.data = c->data;
+	c->info.size = c->size;
+	c->info.meta = NULL;
+
+	bool inarchive = !c->archive_path.empty();
+	c->info_ext.full_path = inarchive ? c->archive_path.c_str() : c->path.c_str();
+	c->info_ext.archive_path = inarchive ? c->archive_path.c_str() : NULL;
+	c->info_ext.archive_file = inarchive ? c->archive_file.c_str() : NULL;
+	c->info_ext.dir = c->dir.c_str();
+	c->info_ext.name = c->name.c_str();
+	c->info_ext.ext = c->ext.c_str();
+	c->info_ext.meta = NULL;
+	c->info_ext.data = c->data;
+	c->info_ext.size = c->size;
+	c->info_ext.file_in_archive = inarchive;
+	c->info_ext.persistent_data = (c->data != NULL);
+	return true;
+}
+
+void content_close(content_t *c) {
+	if (c->map)
+		munmap(c->map, c->mapsize);
+	if (c->dmap)
+		munmap(c->dmap, c->dmapsize);
+	if (c->memfd >= 0)
+		close(c->memfd);
+	c->data = c->map = c->dmap = NULL;
+	c->size = c->mapsize = c->dmapsize = 0;
+	c->memfd = -1;
+}
@@ -0,0 +1,42 @@
+// Copyright 2021 David Guillen Fandos <david@davidgf.net>
+// Released under the GPL2 license
+
+#ifndef _CONTENT_H__
+#define _CONTENT_H__
+
+#include <string>
+#include "libretro.h"
+
+// Content (ROM) loading. The file is mmap'ed (private, copy-on-write) instead
+// of being read into a heap buffer, and the mapping stays valid until
+// content_close(), so it is reported as persistent to the cores (which can
+// then use it without copying). Also keeps the data for GET_GAME_INFO_EXT.
+//
+// Compressed content (.gz files and .zip archives) is inflated in memory,
+// into a memfd. Cores that need a path get /proc/self/fd/N. A zip entry can
+// be selected with "archive.zip#path/in/archive" (defaults to the first file).
+// Archives are passed as they are to cores that block extraction or list the
+// archive extension as valid (like arcade cores taking zipped romsets).
+
+typedef struct {
+	std::string path, dir, name, ext;
+	std::string archive_path, archive_file;   // Only for compressed content
+	void *data;
+	size_t size;
+	void *map, *dmap;        // File/archive mapping and memfd mapping (owned)
+	size_t mapsize, dmapsize;
+	int memfd;
+	struct retro_game_info info;
+	struct retro_game_info_ext info_ext;
+} content_t;
+
+// Records the core overrides (SET_CONTENT_INFO_OVERRIDE).
+void content_set_overrides(const struct retro_system_content_info_override *ovr);
+
+// Opens the content, mapping it unless only the path is needed (need_fullpath
+// as reported by the core info, the overrides are applied on top of it).
+// MAP_POPULATE prefaults it (fewer page faults, slower startup).
+bool content_open(content_t *c, const std::string &path, const struct retro_system_info *sysinfo, bool populate);
+void content_close(content_t *c);
+
+#endif
@@ -0,0 +1,164 @@
+// Copyright 2021 David Guillen Fandos <david@davidgf.net>
+// Released under the GPL2 license
+
+#include <string.h>
+#include <algorithm>
+#include <deque>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+#include "coreopts.h"
+
+typedef struct {
+	std::string key;
+	const char *value;    // Interned, see intern_value()
+	bool overridden;      // Value comes from the user
+	bool declared;        // Defined by the core
+	std::vector<std::string> choices;
+} coreopt_t;
+
+// Entries live in a deque so that their key/value strings never move
+static std::deque<coreopt_t> options;
+// Every value handed out to the core is kept alive (set nodes never move),
+// a later SET_VARIABLE or redefinition must not free what it still holds
+static std::unordered_set<std::string> values;
+static std::unordered_map<std::string, coreopt_t*> bykey;
+static std::unordered_map<const char*, coreopt_t*> byptr;
+static std::vector<coreopt_t*> declared;    // In declaration order
+static bool updated = false;
+static unsigned long lookups = 0, misses = 0, frame_lookups = 0;
+static unsigned long frames = 0, max_frame_lookups = 0;
+
+static const char *intern_value(const std::string &value) {
+	return values.insert(value).first->c_str();
+}
+
+static coreopt_t *intern(const std::string &key) {
+	auto it = bykey.find(key);
+	if (it != bykey.end())
+		return it->second;
+	options.push_back({key, intern_value(""), false, false, {}});
+	bykey[key] = &options.back();
+	return &options.back();
+}
+
+void coreopts_override(const std::string &key, const std::string &value) {
+	coreopt_t *opt = intern(key);
+	opt->value = intern_value(value);
+	opt->overridden = true;
+}
+
+static void define(const char *key, const char *defval, const std::vector<std::string> &choices) {
+	coreopt_t *opt = intern(key);
+	if (!opt->overridden)
+		opt->value = intern_value(defval ? defval : "");
+	if (!opt->declared)
+		declared.push_back(opt);
+	opt->declared = true;
+	opt->choices = choices;
+}
+
+void coreopts_define_variables(const struct retro_variable *vars) {
+	// Values look like "Description; default|value2|value3"
+	for (; vars->key; vars++) {
+		const char *v = vars->value ? strchr(vars->value, ';') : NULL;
+		std::vector<std::string> choices;
+		if (v) {
+			for (v++; *v == ' '; v++);
+			while (*v) {
+				size_t l = strcspn(v, "|");
+				choices.push_back(std::string(v, l));
+				v += v[l] ? l + 1 : l;
+			}
+		}
+		define(vars->key, choices.empty() ? "" : choices[0].c_str(), choices);
+	}
+}
+
+template<typename T>
+static void define_values(const T *def) {
+	std::vector<std::string> choices;
+	for (unsigned i = 0; i < RETRO_NUM_CORE_OPTION_VALUES_MAX && def->values[i].value; i++)
+		choices.push_back(def->values[i].value);
+	define(def->key, def->default_value ? def->default_value : def->values[0].value, choices);
+}
+
+void coreopts_define(const struct retro_core_option_definition *defs) {
+	for (; defs->key; defs++)
+		define_values(defs);
+}
+
+void coreopts_define_v2(const struct retro_core_options_v2 *opts) {
+	for (const struct retro_core_option_v2_definition *defs = opts->definitions; defs->key; defs++)
+		define_values(defs);
+}
+
+std::vector<std::string> coreopts_declared() {
+	std::vector<std::string> ret;
+	for (auto opt : declared)
+		ret.push_back(opt->key);
+	return ret;
+}
+
+bool coreopts_choices(const std::string &key, std::string *value, std::vector<std::string> *choices) {
+	auto it = bykey.find(key);
+	if (it == bykey.end() || !it->second->declared)
+		return false;
+	*value = it->second->value;
+	*choices = it->second->choices;
+	return true;
+}
+
+static coreopt_t *lookup(const char *key) {
+	// Cores usually pass string literals, validate the cached pointer anyway
+	// since the key could live in a reused buffer.
+	auto it = byptr.find(key);
+	if (it != byptr.end() && !strcmp(it->second->key.c_str(), key))
+		return it->second;
+
+	misses++;
+	auto kit = bykey.find(key);
+	if (kit == bykey.end())
+		return NULL;
+	byptr[key] = kit->second;
+	return kit->second;
+}
+
+bool coreopts_get(struct retro_variable *var) {
+	lookups++;
+	frame_lookups++;
+	coreopt_t *opt = var->key ? lookup(var->key) : NULL;
+	var->value = opt ? opt->value : NULL;
+	return opt != NULL;
+}
+
+bool coreopts_set(const struct retro_variable *var) {
+	if (!var)
+		return true;
+	if (!var->key || !var->value || !bykey.count(var->key))
+		return false;
+	coreopt_t *opt = bykey.at(var->key);
+	if (strcmp(opt->value, var->value)) {
+		opt->value = intern_value(var->value);
+		updated = true;
+	}
+	return true;
+}
+
+bool coreopts_updated() {
+	bool ret = updated;
+	updated = false;
+	return ret;
+}
+
+void coreopts_end_frame() {
+	max_frame_lookups = std::max(max_frame_lookups, frame_lookups);
+	frame_lookups = 0;
+	frames++;
+}
+
+void coreopts_report(std::ostream &os) {
+	os << "Core variable lookups: " << lookups << " total (" << misses << " by name), "
+	   << max_frame_lookups << " max per frame, "
+	   << (frames ? (double)lookups / frames : 0) << " average per frame" << std::endl;
+}
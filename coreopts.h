@@ -0,0 +1,45 @@
+// Copyright 2021 David Guillen Fandos <david@davidgf.net>
+// Released under the GPL2 license
+
+#ifndef _COREOPTS_H__
+#define _COREOPTS_H__
+
+#include <string>
+#include <vector>
+#include <ostream>
+#include "libretro.h"
+
+// Core options (variables). Definitions from SET_VARIABLES, SET_CORE_OPTIONS
+// (and their INTL and V2 variants) are interned into a table once, together
+// with the user overrides (--envvar). GET_VARIABLE lookups are answered from
+// that table (first by key pointer, which cores usually keep constant) and
+// return stable value pointers.
+
+// Version reported via GET_CORE_OPTIONS_VERSION
+#define COREOPTS_VERSION 2
+
+// User provided value, takes precedence over the core default.
+void coreopts_override(const std::string &key, const std::string &value);
+
+// Option definitions (arrays are terminated by a NULL key).
+void coreopts_define_variables(const struct retro_variable *vars);
+void coreopts_define(const struct retro_core_option_definition *defs);
+void coreopts_define_v2(const struct retro_core_options_v2 *opts);
+
+// Keys declared by the core (in declaration order), and for a given key its
+// current value and declared choices (false if the core did not declare it).
+std::vector<std::string> coreopts_declared();
+bool coreopts_choices(const std::string &key, std::string *value, std::vector<std::string> *choices);
+
+// GET_VARIABLE / SET_VARIABLE / GET_VARIABLE_UPDATE handlers
+bool coreopts_get(struct retro_variable *var);
+bool coreopts_set(const struct retro_variable *var);
+bool coreopts_updated();
+
+// Closes the per-frame lookup accounting, to be called after every frame.
+void coreopts_end_frame();
+
+// Prints the lookup statistics.
+void coreopts_report(std::ostream &os);
+
+#endif
@@ -2,7 +2,7 @@
 // Copyright 2021 David Guillen Fandos <david@davidgf.net>
 // Released under the GPL2 license
 // Runs two cores alongside and compares them (using their
-// serialized state).
+// serialized state, or their RAM contents with --compare-ram).
 
 #include <iostream>
 #include <stdio.h>
@@ -10,10 +10,13 @@
 #include <unistd.h>
 #include <string.h>
 #include <signal.h>
+#include <set>
 #include "argparse.hpp"
 #include "libretro.h"
 #include "util.h"
 #include "loader.h"
+#include "memmap.h"
+#include "content.h"
 
 typedef RETRO_CALLCONV void (*core_info_function)(struct retro_system_info *info);
 typedef RETRO_CALLCONV void (*core_action_function)(void);
@@ -42,6 +45,8 @@ std::unordered_map<unsigned, unsigned> icmds;
 std::string systemdir;
 unsigned curr_core = 0;
 unsigned frame_counter[2] = {0, 0};
+memory_map_t memmap[2];
+content_t content;      // Shared by both cores
 enum retro_pixel_format videofmt = RETRO_PIXEL_FORMAT_0RGB1555;
 
 void RETRO_CALLCONV logging_callback(enum retro_log_level level, const char *fmt, ...) {
@@ -66,6 +71,20 @@ bool RETRO_CALLCONV env_callback(unsigned cmd, void *data) {
 		return true;
 	case RETRO_ENVIRONMENT_GET_VARIABLE_UPDATE:
 		return false;
+	case RETRO_ENVIRONMENT_GET_INPUT_BITMASKS:
+		// We can return all the joypad buttons at once (RETRO_DEVICE_ID_JOYPAD_MASK)
+		if (data)
+			*(bool*)data = true;
+		return true;
+	case RETRO_ENVIRONMENT_SET_CONTENT_INFO_OVERRIDE:
+		// Both path and data are always provided, the data is persistent
+		return true;
+	case RETRO_ENVIRONMENT_GET_GAME_INFO_EXT:
+		*(const struct retro_game_info_ext**)data = &content.info_ext;
+		return true;
+	case RETRO_ENVIRONMENT_SET_MEMORY_MAPS:
+		memmap_set(&memmap[curr_core], (const struct retro_memory_map*)data);
+		return true;
 	case RETRO_ENVIRONMENT_GET_LOG_INTERFACE:
 		((struct retro_log_callback*)data)->log = &logging_callback;
 		return true;
@@ -90,8 +109,27 @@ size_t RETRO_CALLCONV audio_buffer(const int16_t *data, size_t frames) {
 	return frames;   // TODO: output audio
 }
 
+// Extensions in a core's valid_extensions list ("ext1|ext2|..."), lowercase
+std::set<std::string> ext_list(const char *e) {
+	std::set<std::string> ret;
+	while (e && *e) {
+		size_t l = strcspn(e, "|");
+		std::string ext(e, l);
+		for (auto &ch : ext)
+			ch = tolower(ch);
+		ret.insert(ext);
+		e += e[l] ? l + 1 : l;
+	}
+	return ret;
+}
+
 int16_t RETRO_CALLCONV input_state(unsigned port, unsigned device, unsigned index, unsigned id) {
-	if (icmds.count(frame_counter[curr_core]) && (icmds.at(frame_counter[curr_core]) & (1 << id)))
+	auto it = icmds.find(frame_counter[curr_core]);
+	if (it == icmds.end())
+		return 0;
+	if (device == RETRO_DEVICE_JOYPAD && id == RETRO_DEVICE_ID_JOYPAD_MASK)
+		return it->second;
+	if (it->second & (1 << id))
 		return 1;
 	// No input for now
 	return 0;
@@ -111,6 +149,9 @@ int main(int argc, char **argv) {
 	// Read input commands
 	parser.addArgument("-i", "--input", 1);
 
+	// Compare system/save RAM hashes instead of the (bigger) serialized state
+	parser.addArgument("--compare-ram", '*');
+
 	parser.parse(argc, (const char **)argv);
 
 	// Read the args
@@ -118,6 +159,7 @@ int main(int argc, char **argv) {
 	std::string rom_file = parser.retrieve<std::string>("r");
 	corefile1 = parser.retrieve<std::string>("c");
 	corefile2 = parser.retrieve<std::string>("d");
+	bool cmpram = parser.gotArgument("compare-ram");
 	unsigned maxframes = 300;
 	if (parser.gotArgument("frames"))
 		maxframes = parser.retrieve<unsigned>("frames");
@@ -146,6 +188,7 @@ int main(int argc, char **argv) {
 
 	// Set the required callbacks
 	for (int i = 0; i < 2; i++) {
+		curr_core = i;
 		retrofns[i]->core_set_env_function(&env_callback);
 		retrofns[i]->core_set_video_refresh_function(&video_update);
 		retrofns[i]->core_set_audio_sample_function(&single_sample);
@@ -159,41 +202,66 @@ int main(int argc, char **argv) {
 
 	// Init the core and load the ROM
 	std::cout << "Loading ROM " << rom_file << std::endl;
-	struct retro_game_info gameinfo = {.path = rom_file.c_str(), .data = NULL, .size = 0, .meta = NULL};
-	void *dptr = NULL;
-	{
-		FILE *fd = fopen(rom_file.c_str(), "rb");
-		fseek(fd, 0, SEEK_END);
-		gameinfo.size = ftell(fd);
-		fseek(fd, 0, SEEK_SET);
-		dptr = malloc(gameinfo.size);
-		fread(dptr, 1, gameinfo.size, fd);
-		fclose(fd);
+	// Both cores get the same content: data is always mapped (even if one
+	// of them only needs the path) and archives are only passed as they are
+	// if both cores take them.
+	struct retro_system_info info[2];
+	for (int i = 0; i < 2; i++)
+		retrofns[i]->core_get_info(&info[i]);
+	std::set<std::string> exts[2] = {
+		ext_list(info[0].valid_extensions), ext_list(info[1].valid_extensions) };
+	std::string valid;
+	for (const auto &e : info[0].block_extract ? exts[1] : exts[0])
+		if (info[0].block_extract || info[1].block_extract || exts[1].count(e))
+			valid += (valid.empty() ? "" : "|") + e;
+	struct retro_system_info merged = info[0];
+	merged.need_fullpath = false;
+	merged.block_extract = info[0].block_extract && info[1].block_extract;
+	merged.valid_extensions = valid.c_str();
+	if (!content_open(&content, rom_file, &merged, false)) {
+		std::cerr << "Could not open ROM " << rom_file << std::endl;
+		return 1;
 	}
-	gameinfo.data = dptr;
 
 	for (int i = 0; i < 2; i++) {
-		if (!retrofns[i]->core_load_game(&gameinfo)) {
+		curr_core = i;
+		if (!retrofns[i]->core_load_game(&content.info)) {
 			std::cout << "Failed to load the game, retro_load_game returned false!" << std::endl;
 			return -1;
 		}
 		retrofns[i]->core_reset();
 	}
 
-	void *serstate[2];
-	size_t sersz = retrofns[0]->core_serialize_size();
+	// Comparing RAM requires something to compare (hashes would be zero)
+	for (int i = 0; i < 2 && cmpram; i++) {
+		if (!memory_size(retrofns[i], &memmap[i], RETRO_MEMORY_SYSTEM_RAM) &&
+		    !memory_size(retrofns[i], &memmap[i], RETRO_MEMORY_SAVE_RAM)) {
+			std::cerr << "Core " << (i ? corefile2 : corefile1)
+			          << " exposes no system or save RAM, cannot use --compare-ram" << std::endl;
+			return 1;
+		}
+	}
+
+	void *serstate[2] = {NULL, NULL};
+	size_t sersz = cmpram ? 0 : retrofns[0]->core_serialize_size();
 	for (int j = 0; j < 2; j++)
 		serstate[j] = malloc(sersz);
 
 	for (unsigned i = 0; i < maxframes; i++) {
+		uint64_t ramh[2][2];
 		for (int j = 0; j < 2; j++) {
 			curr_core = j;
 			retrofns[j]->core_run();
-			retrofns[j]->core_serialize(serstate[j], sersz);
+			if (cmpram) {
+				ramh[j][0] = memory_hash(retrofns[j], &memmap[j], RETRO_MEMORY_SYSTEM_RAM);
+				ramh[j][1] = memory_hash(retrofns[j], &memmap[j], RETRO_MEMORY_SAVE_RAM);
+			}
+			else
+				retrofns[j]->core_serialize(serstate[j], sersz);
 		}
 
 		// Compare states
-		if (memcmp(serstate[0], serstate[1], sersz)) {
+		if (cmpram ? memcmp(ramh[0], ramh[1], sizeof(ramh[0])) : memcmp(serstate[0], serstate[1], sersz)) {
 			printf("Mismatch in frame %d\n", i);
 			break;
 		}
@@ -203,8 +271,7 @@ int main(int argc, char **argv) {
 		retrofns[j]->core_deinit();
 		free(retrofns[j]);
 	}
-	if (dptr)
-		free(dptr);
+	content_close(&content);
 }
 
 
@@ -0,0 +1,176 @@
+// Copyright 2021 David Guillen Fandos <david@davidgf.net>
+// Released under the GPL2 license
+
+#include <stdio.h>
+#include <string.h>
+#include <chrono>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <vector>
+#include "encoder.h"
+#include "util.h"
+
+enum slot_state { SLOT_FREE, SLOT_FILLING, SLOT_READY, SLOT_BUSY };
+
+typedef struct {
+	slot_state state;
+	unsigned long seq;
+	unsigned width, height;
+	enum retro_pixel_format fmt;
+	std::string filename;
+	scratch_buffer_t raw;       // Frame data, tightly packed (no pitch padding)
+	frame_buffer_t *fb;         // Or a retained pool framebuffer (no copy)
+	size_t pitch;
+} enc_slot_t;
+
+typedef struct {
+	std::vector<enc_slot_t> slots;
+	std::vector<std::thread> workers;
+	std::mutex mu;
+	std::condition_variable cv_free, cv_ready, cv_written;
+	unsigned long head, tail;   // Next slot to fill and next slot to encode
+	unsigned long next_write;   // Sequence number of the next file to write
+	unsigned depth;             // Slots currently in use
+	bool drop, quit;
+	encoder_stats_t stats;
+} encoder_t;
+
+// Heap allocated on purpose: it's never destroyed if we exit() abruptly
+static encoder_t *enc = NULL;
+
+static unsigned pixel_size(enum retro_pixel_format fmt) {
+	return fmt == RETRO_PIXEL_FORMAT_XRGB8888 ? 4 : 2;
+}
+
+static void encoder_worker() {
+	scratch_buffer_t rgbbuf = {0};
+	std::unique_lock<std::mutex> lock(enc->mu);
+	while (true) {
+		enc->cv_ready.wait(lock, [] {
+			return enc->quit || enc->slots[enc->tail % enc->slots.size()].state == SLOT_READY;
+		});
+		enc_slot_t *slot = &enc->slots[enc->tail % enc->slots.size()];
+		if (slot->state != SLOT_READY)
+			break;    // Quitting and there's nothing left to do
+		slot->state = SLOT_BUSY;
+		enc->tail++;
+		lock.unlock();
+
+		// Convert and encode in parallel with other workers
+		uint8_t *rgb = (uint8_t*)scratch_reserve(&rgbbuf, slot->width * slot->height * 3);
+		if (slot->fb) {
+			image_convert(slot->fb->data, slot->width, slot->height, slot->pitch, slot->fmt, rgb);
+			fbpool_release(slot->fb);
+			slot->fb = NULL;
+		}
+		else
+			image_convert(slot->raw.data, slot->width, slot->height, slot->width * pixel_size(slot->fmt), slot->fmt, rgb);
+		int pnglen = 0;
+		uint8_t *png = encode_png(rgb, slot->width, slot->height, &pnglen);
+
+		// Files are written in the same order they were submitted
+		lock.lock();
+		enc->cv_written.wait(lock, [slot] { return enc->next_write == slot->seq; });
+		lock.unlock();
+		FILE *fd = fopen(slot->filename.c_str(), "wb");
+		if (fd) {
+			fwrite(png, 1, pnglen, fd);
+			fclose(fd);
+		}
+		free(png);
+		lock.lock();
+
+		enc->next_write++;
+		slot->state = SLOT_FREE;
+		enc->depth--;
+		enc->cv_written.notify_all();
+		enc->cv_free.notify_one();
+	}
+	scratch_free(&rgbbuf);
+}
+
+void encoder_start(unsigned nthreads, unsigned depth, bool drop) {
+	// Forked runs restart it, the instance is reused (it outlives
+	// encoder_stop so that its stats can be read)
+	if (!enc)
+		enc = new encoder_t();
+	enc->slots.assign(depth ? depth : 1, enc_slot_t());
+	for (auto & s : enc->slots) {
+		s.state = SLOT_FREE;
+		s.raw = {0};
+		s.fb = NULL;
+	}
+	enc->head = enc->tail = enc->next_write = 0;
+	enc->depth = 0;
+	enc->drop = drop;
+	enc->quit = false;
+	enc->stats = {0};
+	enc->stats.capacity = enc->slots.size();
+	for (unsigned i = 0; i < nthreads; i++)
+		enc->workers.emplace_back(encoder_worker);
+}
+
+void encoder_submit(const void *data, unsigned width, unsigned height, size_t pitch,
+                    enum retro_pixel_format fmt, const std::string &filename, frame_buffer_t *fb) {
+	std::unique_lock<std::mutex> lock(enc->mu);
+	enc_slot_t *slot = &enc->slots[enc->head % enc->slots.size()];
+	if (slot->state != SLOT_FREE) {
+		if (enc->drop) {
+			enc->stats.dropped++;
+			return;
+		}
+		auto start = std::chrono::steady_clock::now();
+		enc->cv_free.wait(lock, [slot] { return slot->state == SLOT_FREE; });
+		auto end = std::chrono::steady_clock::now();
+		enc->stats.blocked++;
+		enc->stats.blocked_ns += std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count();
+	}
+	slot->state = SLOT_FILLING;
+	slot->seq = enc->head++;
+	enc->depth++;
+	enc->stats.submitted++;
+	enc->stats.max_depth = std::max(enc->stats.max_depth, enc->depth);
+	lock.unlock();
+
+	if (fb) {
+		// The core rendered into our memory, just hold on to it
+		fbpool_retain(fb);
+		slot->fb = fb;
+		slot->pitch = pitch;
+	}
+	else {
+		// Copy the visible pixels only, the slot buffer is reused across frames
+		unsigned rowsize = width * pixel_size(fmt);
+		uint8_t *dst = (uint8_t*)scratch_reserve(&slot->raw, rowsize * height);
+		for (unsigned row = 0; row < height; row++)
+			memcpy(&dst[row * rowsize], &((const uint8_t*)data)[row * pitch], rowsize);
+	}
+	slot->width = width;
+	slot->height = height;
+	slot->fmt = fmt;
+	slot->filename = filename;
+
+	lock.lock();
+	slot->state = SLOT_READY;
+	enc->cv_ready.notify_all();
+}
+
+void encoder_stop() {
+	{
+		std::unique_lock<std::mutex> lock(enc->mu);
+		enc->quit = true;
+		enc->cv_ready.notify_all();
+	}
+	for (auto & t : enc->workers)
+		t.join();
+	enc->workers.clear();
+	for (auto & s : enc->slots)
+		scratch_free(&s.raw);
+}
+
+encoder_stats_t encoder_stats() {
+	std::unique_lock<std::mutex> lock(enc->mu);
+	return enc->stats;
+}
+
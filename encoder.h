@@ -0,0 +1,39 @@
+// Copyright 2021 David Guillen Fandos <david@davidgf.net>
+// Released under the GPL2 license
+
+#ifndef _ENCODER_H__
+#define _ENCODER_H__
+
+#include <string>
+#include "libretro.h"
+#include "fbpool.h"
+
+// Asynchronous screenshot encoder. Frames are copied into a bounded ring of
+// raw frames and a pool of worker threads converts them, encodes them as PNG
+// and writes them to disk (in submission order).
+
+typedef struct {
+	unsigned long submitted;    // Frames accepted into the queue
+	unsigned long dropped;      // Frames dropped due to a full queue (drop mode)
+	unsigned long blocked;      // Times the producer had to wait for a free slot
+	unsigned long blocked_ns;   // Total time spent waiting
+	unsigned max_depth;         // Queue high-water mark
+	unsigned capacity;
+} encoder_stats_t;
+
+// Starts the worker threads, with a queue of "depth" frames. If drop is set, frames
+// submitted while the queue is full are discarded instead of blocking the caller.
+// It can be started again after encoder_stop (forked runs do).
+void encoder_start(unsigned nthreads, unsigned depth, bool drop);
+
+// Queues a frame to be written as a PNG file. The frame data is copied, unless
+// it lives in a pool framebuffer, which is then retained until it's encoded.
+void encoder_submit(const void *data, unsigned width, unsigned height, size_t pitch,
+                    enum retro_pixel_format fmt, const std::string &filename, frame_buffer_t *fb = NULL);
+
+// Waits for all the queued frames to be written and stops the workers.
+void encoder_stop();
+
+encoder_stats_t encoder_stats();
+
+#endif
@@ -0,0 +1,78 @@
+// Copyright 2021 David Guillen Fandos <david@davidgf.net>
+// Released under the GPL2 license
+
+#include <stdlib.h>
+#include "fbpool.h"
+
+#define FB_ALIGN  64
+
+static frame_buffer_t *pool = NULL;
+static unsigned pool_size = 0;
+static unsigned long hits = 0;
+
+void fbpool_init(unsigned count) {
+	pool = new frame_buffer_t[count];
+	pool_size = count;
+	for (unsigned i = 0; i < count; i++) {
+		pool[i].data = NULL;
+		pool[i].size = 0;
+		pool[i].refs = 0;
+	}
+}
+
+void fbpool_destroy() {
+	for (unsigned i = 0; i < pool_size; i++)
+		free(pool[i].data);
+	delete[] pool;
+	pool = NULL;
+	pool_size = 0;
+}
+
+frame_buffer_t *fbpool_get(unsigned width, unsigned height, enum retro_pixel_format fmt) {
+	unsigned bpp = fmt == RETRO_PIXEL_FORMAT_XRGB8888 ? 4 : 2;
+	size_t pitch = (width * bpp + FB_ALIGN - 1) & ~(size_t)(FB_ALIGN - 1);
+	for (unsigned i = 0; i < pool_size; i++) {
+		frame_buffer_t *fb = &pool[i];
+		if (fb->refs.load(std::memory_order_acquire))
+			continue;
+
+		// Only reallocate if the buffer is too small
+		if (pitch * height > fb->size) {
+			void *ptr;
+			if (posix_memalign(&ptr, FB_ALIGN, pitch * height))
+				return NULL;
+			free(fb->data);
+			fb->data = ptr;
+			fb->size = pitch * height;
+		}
+		fb->pitch = pitch;
+		fb->width = width;
+		fb->height = height;
+		fb->fmt = fmt;
+		return fb;
+	}
+	return NULL;
+}
+
+frame_buffer_t *fbpool_lookup(const void *data) {
+	for (unsigned i = 0; i < pool_size; i++) {
+		if (pool[i].data == data) {
+			hits++;
+			return &pool[i];
+		}
+	}
+	return NULL;
+}
+
+void fbpool_retain(frame_buffer_t *fb) {
+	fb->refs.fetch_add(1, std::memory_order_relaxed);
+}
+
+void fbpool_release(frame_buffer_t *fb) {
+	fb->refs.fetch_sub(1, std::memory_order_release);
+}
+
+unsigned long fbpool_hits() {
+	return hits;
+}
+
@@ -0,0 +1,40 @@
+// Copyright 2021 David Guillen Fandos <david@davidgf.net>
+// Released under the GPL2 license
+
+#ifndef _FBPOOL_H__
+#define _FBPOOL_H__
+
+#include <stddef.h>
+#include <atomic>
+#include "libretro.h"
+
+// Small pool of frontend-owned framebuffers, handed out to the core via
+// RETRO_ENVIRONMENT_GET_CURRENT_SOFTWARE_FRAMEBUFFER. Rows are cache line
+// aligned. Buffers can be retained by other threads (ie. the screenshot
+// encoder) which then own them until they release them, avoiding a copy.
+
+typedef struct {
+	void *data;
+	size_t size;
+	size_t pitch;
+	unsigned width, height;
+	enum retro_pixel_format fmt;
+	std::atomic<int> refs;      // Non-zero while someone else owns it
+} frame_buffer_t;
+
+void fbpool_init(unsigned count);
+void fbpool_destroy();
+
+// Returns a free buffer for the given frame size and format (NULL if all are busy).
+frame_buffer_t *fbpool_get(unsigned width, unsigned height, enum retro_pixel_format fmt);
+
+// Returns the pool buffer that holds "data" (or NULL if it's not one of ours).
+frame_buffer_t *fbpool_lookup(const void *data);
+
+void fbpool_retain(frame_buffer_t *fb);
+void fbpool_release(frame_buffer_t *fb);
+
+// Number of frames that the core rendered directly into the pool.
+unsigned long fbpool_hits();
+
+#endif
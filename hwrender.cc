@@ -0,0 +1,227 @@
+// Copyright 2021 David Guillen Fandos <david@davidgf.net>
+// Released under the GPL2 license
+
+#include <string.h>
+#include <iostream>
+#include "hwrender.h"
+#include "util.h"
+
+#ifdef HW_RENDER
+
+#define GL_GLEXT_PROTOTYPES
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+#include <GL/gl.h>
+#include <GL/glext.h>
+
+typedef struct {
+	bool valid;
+	unsigned width, height;
+	unsigned frame;
+	uint32_t actions;
+} pending_frame_t;
+
+static struct {
+	bool enabled;
+	struct retro_hw_render_callback cb;
+	hw_frame_fn frame_fn;
+	EGLDisplay dpy;
+	EGLContext ctx;
+	GLuint fbo, color_tex, depth_rb;
+	GLuint pbo[2];
+	unsigned curr;               // PBO to use for the next readback
+	pending_frame_t pending[2];
+	bool read_this_frame;
+	scratch_buffer_t flipbuf;
+} hw = {0};
+
+static uintptr_t RETRO_CALLCONV hw_get_current_framebuffer() {
+	return hw.fbo;
+}
+
+static retro_proc_address_t RETRO_CALLCONV hw_get_proc_address(const char *sym) {
+	return (retro_proc_address_t)eglGetProcAddress(sym);
+}
+
+bool hw_render_setup(struct retro_hw_render_callback *cb, hw_frame_fn frame_fn) {
+	if (cb->context_type != RETRO_HW_CONTEXT_OPENGL && cb->context_type != RETRO_HW_CONTEXT_OPENGL_CORE) {
+		std::cerr << "Unsupported HW context type " << cb->context_type << std::endl;
+		return false;
+	}
+
+	PFNEGLGETPLATFORMDISPLAYEXTPROC get_platform_display =
+		(PFNEGLGETPLATFORMDISPLAYEXTPROC)eglGetProcAddress("eglGetPlatformDisplayEXT");
+	if (!get_platform_display)
+		return false;
+	hw.dpy = get_platform_display(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, NULL);
+	if (hw.dpy == EGL_NO_DISPLAY || !eglInitialize(hw.dpy, NULL, NULL)) {
+		std::cerr << "Could not initialize a surfaceless EGL display" << std::endl;
+		return false;
+	}
+	eglBindAPI(EGL_OPENGL_API);
+
+	// Surfaceless displays expose no window configs, ask for a pbuffer one.
+	const EGLint cfgattrs[] = {
+		EGL_SURFACE_TYPE, EGL_PBUFFER_BIT, EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT, EGL_NONE };
+	EGLConfig config;
+	EGLint numcfg = 0;
+	if (!eglChooseConfig(hw.dpy, cfgattrs, &config, 1, &numcfg) || !numcfg) {
+		std::cerr << "No suitable EGL config found" << std::endl;
+		return false;
+	}
+
+	EGLint ctxattrs[16], n = 0;
+	if (cb->context_type == RETRO_HW_CONTEXT_OPENGL_CORE) {
+		ctxattrs[n++] = EGL_CONTEXT_MAJOR_VERSION;
+		ctxattrs[n++] = cb->version_major;
+		ctxattrs[n++] = EGL_CONTEXT_MINOR_VERSION;
+		ctxattrs[n++] = cb->version_minor;
+		ctxattrs[n++] = EGL_CONTEXT_OPENGL_PROFILE_MASK;
+		ctxattrs[n++] = EGL_CONTEXT_OPENGL_CORE_PROFILE_BIT;
+	}
+	if (cb->debug_context) {
+		ctxattrs[n++] = EGL_CONTEXT_OPENGL_DEBUG;
+		ctxattrs[n++] = EGL_TRUE;
+	}
+	ctxattrs[n++] = EGL_NONE;
+
+	hw.ctx = eglCreateContext(hw.dpy, config, EGL_NO_CONTEXT, ctxattrs);
+	if (hw.ctx == EGL_NO_CONTEXT || !eglMakeCurrent(hw.dpy, EGL_NO_SURFACE, EGL_NO_SURFACE, hw.ctx)) {
+		std::cerr << "Could not create the OpenGL context" << std::endl;
+		return false;
+	}
+	std::cout << "Using HW rendering on " << glGetString(GL_RENDERER) << std::endl;
+
+	cb->get_current_framebuffer = &hw_get_current_framebuffer;
+	cb->get_proc_address = &hw_get_proc_address;
+	hw.cb = *cb;
+	hw.frame_fn = frame_fn;
+	hw.enabled = true;
+	return true;
+}
+
+bool hw_render_enabled() {
+	return hw.enabled;
+}
+
+bool hw_render_init(unsigned max_width, unsigned max_height) {
+	glGenTextures(1, &hw.color_tex);
+	glBindTexture(GL_TEXTURE_2D, hw.color_tex);
+	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, max_width, max_height, 0, GL_BGRA, GL_UNSIGNED_BYTE, NULL);
+	glBindTexture(GL_TEXTURE_2D, 0);
+
+	glGenFramebuffers(1, &hw.fbo);
+	glBindFramebuffer(GL_FRAMEBUFFER, hw.fbo);
+	glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, hw.color_tex, 0);
+	if (hw.cb.depth) {
+		glGenRenderbuffers(1, &hw.depth_rb);
+		glBindRenderbuffer(GL_RENDERBUFFER, hw.depth_rb);
+		glRenderbufferStorage(GL_RENDERBUFFER, hw.cb.stencil ? GL_DEPTH24_STENCIL8 : GL_DEPTH_COMPONENT24,
+		                      max_width, max_height);
+		glFramebufferRenderbuffer(GL_FRAMEBUFFER, hw.cb.stencil ? GL_DEPTH_STENCIL_ATTACHMENT : GL_DEPTH_ATTACHMENT,
+		                          GL_RENDERBUFFER, hw.depth_rb);
+		glBindRenderbuffer(GL_RENDERBUFFER, 0);
+	}
+	if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
+		std::cerr << "Could not create the HW framebuffer" << std::endl;
+		return false;
+	}
+	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+
+	glGenBuffers(2, hw.pbo);
+	for (unsigned i = 0; i < 2; i++) {
+		glBindBuffer(GL_PIXEL_PACK_BUFFER, hw.pbo[i]);
+		glBufferData(GL_PIXEL_PACK_BUFFER, max_width * max_height * 4, NULL, GL_STREAM_READ);
+	}
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+
+	if (hw.cb.context_reset)
+		hw.cb.context_reset();
+	return true;
+}
+
+// Maps the PBO and passes the frame along (flipping it if necessary)
+static void deliver(unsigned idx) {
+	pending_frame_t *p = &hw.pending[idx];
+	if (!p->valid)
+		return;
+	p->valid = false;
+
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, hw.pbo[idx]);
+	const uint8_t *pixels = (const uint8_t*)glMapBuffer(GL_PIXEL_PACK_BUFFER, GL_READ_ONLY);
+	if (pixels) {
+		size_t pitch = p->width * 4;
+		if (hw.cb.bottom_left_origin) {
+			// GL images are stored bottom row first
+			uint8_t *flipped = (uint8_t*)scratch_reserve(&hw.flipbuf, pitch * p->height);
+			for (unsigned row = 0; row < p->height; row++)
+				memcpy(&flipped[row * pitch], &pixels[(p->height - row - 1) * pitch], pitch);
+			pixels = flipped;
+		}
+		hw.frame_fn(pixels, p->width, p->height, pitch, p->frame, p->actions);
+		glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+	}
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+}
+
+void hw_render_readback(unsigned width, unsigned height, unsigned frame, uint32_t actions) {
+	// Kick off an asynchronous read into the current PBO
+	glBindFramebuffer(GL_READ_FRAMEBUFFER, hw.fbo);
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, hw.pbo[hw.curr]);
+	glPixelStorei(GL_PACK_ALIGNMENT, 4);
+	glReadPixels(0, 0, width, height, GL_BGRA, GL_UNSIGNED_BYTE, NULL);
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+	glBindFramebuffer(GL_READ_FRAMEBUFFER, 0);
+	hw.pending[hw.curr] = { true, width, height, frame, actions };
+
+	// And now complete the previous one, which had a whole frame to finish
+	hw.curr ^= 1;
+	deliver(hw.curr);
+	hw.read_this_frame = true;
+}
+
+void hw_render_end_frame() {
+	if (!hw.read_this_frame)
+		hw_render_flush();
+	hw.read_this_frame = false;
+}
+
+void hw_render_flush() {
+	// Oldest first
+	deliver(hw.curr);
+	deliver(hw.curr ^ 1);
+}
+
+void hw_render_deinit() {
+	if (!hw.enabled)
+		return;
+	if (hw.cb.context_destroy)
+		hw.cb.context_destroy();
+	glDeleteBuffers(2, hw.pbo);
+	glDeleteFramebuffers(1, &hw.fbo);
+	glDeleteTextures(1, &hw.color_tex);
+	if (hw.depth_rb)
+		glDeleteRenderbuffers(1, &hw.depth_rb);
+	eglMakeCurrent(hw.dpy, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+	eglDestroyContext(hw.dpy, hw.ctx);
+	eglTerminate(hw.dpy);
+	scratch_free(&hw.flipbuf);
+	hw.enabled = false;
+}
+
+#else
+
+bool hw_render_setup(struct retro_hw_render_callback *cb, hw_frame_fn frame_fn) {
+	std::cerr << "HW rendering requested, but miniretro was built without HW_RENDER" << std::endl;
+	return false;
+}
+
+bool hw_render_enabled() { return false; }
+bool hw_render_init(unsigned max_width, unsigned max_height) { return false; }
+void hw_render_readback(unsigned width, unsigned height, unsigned frame, uint32_t actions) {}
+void hw_render_end_frame() {}
+void hw_render_flush() {}
+void hw_render_deinit() {}
+
+#endif
+
@@ -0,0 +1,41 @@
+// Copyright 2021 David Guillen Fandos <david@davidgf.net>
+// Released under the GPL2 license
+
+#ifndef _HWRENDER_H__
+#define _HWRENDER_H__
+
+#include <stdint.h>
+#include <stddef.h>
+#include "libretro.h"
+
+// Headless OpenGL support for hardware rendered cores (SET_HW_RENDER). Uses a
+// surfaceless EGL context (ie. Mesa's llvmpipe, no GPU or display needed) and
+// reads frames back through two PBOs, so that the transfer of a frame overlaps
+// with the emulation of the next one. Only available if built with HW_RENDER.
+
+// Called with each frame once it has been read back (XRGB8888, top row first).
+typedef void (*hw_frame_fn)(const void *data, unsigned width, unsigned height, size_t pitch,
+                            unsigned frame, uint32_t actions);
+
+// Creates the context for the core request (returns false if not supported).
+bool hw_render_setup(struct retro_hw_render_callback *cb, hw_frame_fn frame_fn);
+bool hw_render_enabled();
+
+// Creates the framebuffer objects and notifies the core (context_reset).
+bool hw_render_init(unsigned max_width, unsigned max_height);
+
+// Starts the readback of the frame the core just rendered. The previous
+// frame (if any) is delivered to the frame callback.
+void hw_render_readback(unsigned width, unsigned height, unsigned frame, uint32_t actions);
+
+// To be called after every frame, delivers any pending frame if no other
+// frame was rendered (so frames are never held for more than one frame).
+void hw_render_end_frame();
+
+// Delivers any pending frame.
+void hw_render_flush();
+
+// Notifies the core (context_destroy) and destroys the context.
+void hw_render_deinit();
+
+#endif
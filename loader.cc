@@ -33,6 +33,8 @@ core_functions_t *load_core(const char *filename) {
 	fns->core_serialize_size = (core_serialize_size_fnt)LOAD_SYMBOL(libhandle, "retro_serialize_size");
 	fns->core_unserialize = (core_unserialize_fnt)LOAD_SYMBOL(libhandle, "retro_unserialize");
 	fns->core_get_system_av_info = (core_get_system_av_info_fnt)LOAD_SYMBOL(libhandle, "retro_get_system_av_info");
+	fns->core_get_memory_data = (core_get_memory_data_fnt)LOAD_SYMBOL(libhandle, "retro_get_memory_data");
+	fns->core_get_memory_size = (core_get_memory_size_fnt)LOAD_SYMBOL(libhandle, "retro_get_memory_size");
 	fns->handle = libhandle;
 
 	return fns;
@@ -72,6 +74,8 @@ core_functions_t *load_core(const char *filename) {
 	fns->core_serialize_size = &retro_serialize_size;
 	fns->core_unserialize = &retro_unserialize;
 	fns->core_get_system_av_info = &retro_get_system_av_info;
+	fns->core_get_memory_data = &retro_get_memory_data;
+	fns->core_get_memory_size = &retro_get_memory_size;
 
 	return fns;
 }
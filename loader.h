@@ -36,6 +36,8 @@ typedef RETRO_CALLCONV bool (*core_serialize_fnt)(void *data, size_t size);
 typedef RETRO_CALLCONV size_t (*core_serialize_size_fnt)(void);
 typedef RETRO_CALLCONV bool (*core_unserialize_fnt)(const void *data, size_t size);
 typedef RETRO_CALLCONV void (*core_get_system_av_info_fnt)(struct retro_system_av_info *info);
+typedef RETRO_CALLCONV void* (*core_get_memory_data_fnt)(unsigned id);
+typedef RETRO_CALLCONV size_t (*core_get_memory_size_fnt)(unsigned id);
 
 typedef struct {
 	core_action_fnt core_init;
@@ -55,6 +57,8 @@ typedef struct {
 	core_serialize_size_fnt core_serialize_size;
 	core_unserialize_fnt core_unserialize;
 	core_get_system_av_info_fnt core_get_system_av_info;
+	core_get_memory_data_fnt core_get_memory_data;
+	core_get_memory_size_fnt core_get_memory_size;
 
 	LIBHANDLE handle;
 } core_functions_t;
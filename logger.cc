@@ -0,0 +1,246 @@
+// Copyright 2021 David Guillen Fandos <david@davidgf.net>
+// Released under the GPL2 license
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <pthread.h>
+#include <zlib.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <unordered_map>
+#include "logger.h"
+#include "util.h"
+
+#define LOG_RING_SIZE   (1 << 20)
+
+typedef struct {
+	unsigned window;              // Frame the count belongs to
+	unsigned count;               // Messages in the current window
+	unsigned long suppressed;     // Total messages dropped
+	unsigned long pending;        // Dropped since the last one that got through
+} log_site_t;
+
+typedef struct {
+	uint8_t buffer[LOG_RING_SIZE];
+	alignas(64) std::atomic<size_t> head;   // Producers (under the mutex)
+	alignas(64) std::atomic<size_t> tail;   // Writer thread
+	std::atomic<bool> quit;
+	std::thread writer;
+	std::mutex mutex;                       // Cores may log from several threads
+	int fd;
+	gzFile gz;
+	enum retro_log_level level;
+	unsigned rate;
+	std::unordered_map<const char*, log_site_t> sites;
+	std::atomic<unsigned> window;
+	std::atomic<unsigned long> messages, filtered;
+	unsigned long limited, blocked;
+} log_state_t;
+
+// Heap allocated on purpose: it's never destroyed if we exit() abruptly
+static log_state_t *logst = NULL;
+static bool atexit_set = false;
+
+static const auto poll_interval = std::chrono::microseconds(500);
+
+static void writer_thread() {
+	while (true) {
+		size_t tail = logst->tail.load(std::memory_order_relaxed);
+		size_t head = logst->head.load(std::memory_order_acquire);
+		if (head == tail) {
+			if (logst->quit.load(std::memory_order_acquire) &&
+			    logst->head.load(std::memory_order_acquire) == tail)
+				break;
+			std::this_thread::sleep_for(poll_interval);
+			continue;
+		}
+
+		size_t offset = tail & (LOG_RING_SIZE - 1);
+		size_t chunk = std::min(head - tail, LOG_RING_SIZE - offset);
+		if (logst->gz)
+			gzwrite(logst->gz, &logst->buffer[offset], chunk);
+		else
+			write_all(logst->fd, &logst->buffer[offset], chunk);
+		logst->tail.store(tail + chunk, std::memory_order_release);
+	}
+}
+
+// Copies a message into the ring (waits for room), called with the mutex held
+static void push(const char *msg, size_t size) {
+	size_t head = logst->head.load(std::memory_order_relaxed);
+	bool blocked = false;
+	while (size) {
+		size_t avail = LOG_RING_SIZE - (head - logst->tail.load(std::memory_order_acquire));
+		if (!avail) {
+			blocked = true;
+			std::this_thread::sleep_for(poll_interval);
+			continue;
+		}
+		size_t offset = head & (LOG_RING_SIZE - 1);
+		size_t chunk = std::min(std::min(size, avail), LOG_RING_SIZE - offset);
+		memcpy(&logst->buffer[offset], msg, chunk);
+		head += chunk;
+		msg += chunk;
+		size -= chunk;
+		logst->head.store(head, std::memory_order_release);
+	}
+	logst->blocked += blocked ? 1 : 0;
+}
+
+bool log_start(enum retro_log_level level, unsigned rate, const std::string &filename) {
+	int fd = STDOUT_FILENO;
+	gzFile gz = NULL;
+	if (!filename.empty()) {
+		fd = open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+		if (fd < 0)
+			return false;
+		if (filename.size() > 3 && !filename.compare(filename.size() - 3, 3, ".gz"))
+			gz = gzdopen(fd, "wb");
+	}
+
+	logst = new log_state_t();
+	logst->head = 0;
+	logst->tail = 0;
+	logst->quit = false;
+	logst->fd = fd;
+	logst->gz = gz;
+	logst->level = level;
+	logst->rate = rate;
+	logst->window = 0;
+	logst->messages = 0;
+	logst->filtered = 0;
+	logst->limited = logst->blocked = 0;
+
+	// Signals (the frame alarm) must not land on the writer, exit() joins it
+	sigset_t all, prev;
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &prev);
+	logst->writer = std::thread(writer_thread);
+	pthread_sigmask(SIG_SETMASK, &prev, NULL);
+	if (!atexit_set) {
+		atexit_set = true;
+		atexit(log_stop);
+	}
+	return true;
+}
+
+void log_stop() {
+	if (!logst || logst->quit)
+		return;
+	logst->quit.store(true, std::memory_order_release);
+	logst->writer.join();
+	if (logst->gz)
+		gzclose(logst->gz);
+	else if (logst->fd != STDOUT_FILENO)
+		close(logst->fd);
+}
+
+void log_fork_prepare() {
+	std::lock_guard<std::mutex> g(logst->mutex);
+	while (logst->tail.load(std::memory_order_acquire) != logst->head.load(std::memory_order_relaxed))
+		std::this_thread::sleep_for(poll_interval);
+	if (logst->gz)
+		gzflush(logst->gz, Z_SYNC_FLUSH);
+}
+
+bool log_fork_child(const std::string &filename) {
+	// The writer thread does not exist in the child: its handle cannot be
+	// joined, detaching it lets the old state be freed
+	log_state_t *old = logst;
+	old->writer.detach();
+	if (old->gz) {
+		// Point the fd to /dev/null first, the trailer must not reach the parent's file
+		int nullfd = open("/dev/null", O_WRONLY | O_CLOEXEC);
+		if (nullfd >= 0) {
+			dup2(nullfd, old->fd);
+			close(nullfd);
+		}
+		gzclose(old->gz);
+	}
+	else if (old->fd != STDOUT_FILENO)
+		close(old->fd);
+	enum retro_log_level level = old->level;
+	unsigned rate = old->rate;
+	delete old;
+	logst = NULL;
+	return log_start(level, rate, filename);
+}
+
+void RETRO_CALLCONV log_callback(enum retro_log_level level, const char *fmt, ...) {
+	logst->messages++;
+	if (level < logst->level) {
+		logst->filtered++;
+		return;
+	}
+
+	std::lock_guard<std::mutex> g(logst->mutex);
+	char tmp[64];
+	if (logst->rate) {
+		log_site_t &site = logst->sites[fmt];
+		unsigned window = logst->window.load(std::memory_order_relaxed);
+		if (site.window != window) {
+			site.window = window;
+			site.count = 0;
+		}
+		if (site.count >= logst->rate) {
+			site.suppressed++;
+			site.pending++;
+			logst->limited++;
+			return;
+		}
+		site.count++;
+		if (site.pending) {
+			int n = snprintf(tmp, sizeof(tmp), "[%lu messages suppressed]\n", site.pending);
+			push(tmp, n);
+			site.pending = 0;
+		}
+	}
+
+	char buf[1024];
+	va_list args;
+	va_start(args, fmt);
+	int n = vsnprintf(buf, sizeof(buf), fmt, args);
+	va_end(args);
+	if (n < 0)
+		return;
+	if ((size_t)n < sizeof(buf))
+		push(buf, n);
+	else {
+		std::vector<char> big(n + 1);
+		va_start(args, fmt);
+		vsnprintf(big.data(), big.size(), fmt, args);
+		va_end(args);
+		push(big.data(), n);
+	}
+}
+
+void log_end_frame() {
+	logst->window++;
+}
+
+void log_report(std::ostream &os) {
+	std::lock_guard<std::mutex> g(logst->mutex);
+	os << "Core log: " << logst->messages << " messages, " << logst->filtered
+	   << " below the log level, " << logst->limited << " rate limited, ring full "
+	   << logst->blocked << " times" << std::endl;
+
+	std::vector<std::pair<unsigned long, const char*>> top;
+	for (const auto &it : logst->sites)
+		if (it.second.suppressed)
+			top.push_back(std::make_pair(it.second.suppressed, it.first));
+	std::sort(top.rbegin(), top.rend());
+	for (unsigned i = 0; i < top.size() && i < 10; i++) {
+		std::string site(top[i].second);
+		site.erase(std::remove(site.begin(), site.end(), '\n'), site.end());
+		os << "  " << top[i].first << " messages suppressed from \"" << site << "\"" << std::endl;
+	}
+}
@@ -0,0 +1,39 @@
+// Copyright 2021 David Guillen Fandos <david@davidgf.net>
+// Released under the GPL2 license
+
+#ifndef _LOGGER_H__
+#define _LOGGER_H__
+
+#include <string>
+#include <ostream>
+#include "libretro.h"
+
+// Core logging (GET_LOG_INTERFACE). Messages below the configured level are
+// dropped before formatting, every call site (format string) can be limited
+// to a number of messages per frame, and formatted messages go through a ring
+// buffer that a background thread writes to stdout or a file (gzip
+// compressed if its name ends in ".gz").
+
+// Starts the writer thread. An empty filename means stdout. A zero rate
+// disables the per-site limit. Returns false if the file cannot be opened.
+bool log_start(enum retro_log_level level, unsigned rate, const std::string &filename);
+
+// Flushes everything and stops the writer (also runs at exit).
+void log_stop();
+
+// Fork support (for the modes that fork workers from a loaded core): the
+// parent drains the ring before forking, the child discards the inherited
+// state and starts its own writer (same level and rate, new output file).
+void log_fork_prepare();
+bool log_fork_child(const std::string &filename);
+
+// The retro_log_printf_t handed to the core.
+void RETRO_CALLCONV log_callback(enum retro_log_level level, const char *fmt, ...);
+
+// Starts a new rate limiting window, to be called after every frame.
+void log_end_frame();
+
+// Prints message counts and the sites that were rate limited the most.
+void log_report(std::ostream &os);
+
+#endif
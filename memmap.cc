@@ -0,0 +1,111 @@
+// Copyright 2021 David Guillen Fandos <david@davidgf.net>
+// Released under the GPL2 license
+
+#include "memmap.h"
+#include "util.h"
+
+void memmap_set(memory_map_t *mm, const struct retro_memory_map *map) {
+	mm->descs.assign(map->descriptors, map->descriptors + map->num_descriptors);
+}
+
+static uint64_t memdesc_flag(unsigned id) {
+	switch (id) {
+	case RETRO_MEMORY_SYSTEM_RAM: return RETRO_MEMDESC_SYSTEM_RAM;
+	case RETRO_MEMORY_SAVE_RAM:   return RETRO_MEMDESC_SAVE_RAM;
+	case RETRO_MEMORY_VIDEO_RAM:  return RETRO_MEMDESC_VIDEO_RAM;
+	default:                      return 0;
+	};
+}
+
+// Walks the descriptors tagged with the region flag, skipping mirrors (same
+// backing memory), calls fn(ptr, len) until it returns false.
+template<typename F>
+static void foreach_desc(const memory_map_t *mm, unsigned id, F fn) {
+	uint64_t flag = memdesc_flag(id);
+	for (unsigned i = 0; i < mm->descs.size(); i++) {
+		const auto &d = mm->descs[i];
+		if (!(d.flags & flag) || !d.ptr || !d.len)
+			continue;
+		const uint8_t *p = (const uint8_t*)d.ptr + d.offset;
+		bool dupe = false;
+		for (unsigned j = 0; j < i && !dupe; j++) {
+			const auto &e = mm->descs[j];
+			dupe = (e.flags & flag) && e.ptr && e.len && (const uint8_t*)e.ptr + e.offset == p;
+		}
+		if (!dupe && !fn(p, d.len))
+			return;
+	}
+}
+
+size_t memory_size(const core_functions_t *core, const memory_map_t *mm, unsigned id) {
+	if (core->core_get_memory_data && core->core_get_memory_size) {
+		size_t size = core->core_get_memory_size(id);
+		if (core->core_get_memory_data(id) && size)
+			return size;
+	}
+
+	size_t total = 0;
+	foreach_desc(mm, id, [&](const uint8_t *p, size_t len) {
+		total += len;
+		return true;
+	});
+	return total;
+}
+
+uint64_t memory_hash(const core_functions_t *core, const memory_map_t *mm, unsigned id) {
+	if (core->core_get_memory_data && core->core_get_memory_size) {
+		const void *ptr = core->core_get_memory_data(id);
+		size_t size = core->core_get_memory_size(id);
+		if (ptr && size)
+			return hash64(ptr, size, id);
+	}
+
+	// Chain all the descriptors of the region
+	uint64_t h = 0;
+	foreach_desc(mm, id, [&](const uint8_t *p, size_t len) {
+		h = hash64(p, len, h ^ id);
+		return true;
+	});
+	return h;
+}
+
+// Removes the "disconnect" bits from an address, packing the rest together
+static size_t reduce(size_t addr, size_t mask) {
+	while (mask) {
+		size_t low = (mask - 1) & ~mask;
+		addr = (addr & low) | ((addr >> 1) & ~low);
+		mask = (mask & (mask - 1)) >> 1;
+	}
+	return addr;
+}
+
+const uint8_t *memory_ptr(const core_functions_t *core, const memory_map_t *mm,
+                          unsigned id, size_t addr, size_t len) {
+	if (core->core_get_memory_data && core->core_get_memory_size) {
+		const uint8_t *ptr = (const uint8_t*)core->core_get_memory_data(id);
+		size_t size = core->core_get_memory_size(id);
+		if (ptr && size)
+			return (addr + len <= size) ? &ptr[addr] : NULL;
+	}
+
+	// Emulated addresses, resolved like frontends do for cheats and achievements:
+	// the first descriptor whose start/select matches the address maps it.
+	uint64_t flag = memdesc_flag(id);
+	for (const auto &d : mm->descs) {
+		if (!(d.flags & flag) || !d.ptr || !d.len)
+			continue;
+		size_t off;
+		if (d.select) {
+			if ((addr ^ d.start) & d.select)
+				continue;
+			off = reduce((addr - d.start) & ~d.select, d.disconnect) % d.len;
+		}
+		else {
+			if (addr < d.start || addr - d.start >= d.len)
+				continue;
+			off = addr - d.start;
+		}
+		return (off + len <= d.len) ? (const uint8_t*)d.ptr + d.offset + off : NULL;
+	}
+	return NULL;
+}
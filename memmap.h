@@ -0,0 +1,36 @@
+// Copyright 2021 David Guillen Fandos <david@davidgf.net>
+// Released under the GPL2 license
+
+#ifndef _MEMMAP_H__
+#define _MEMMAP_H__
+
+#include <stdint.h>
+#include <vector>
+#include "libretro.h"
+#include "loader.h"
+
+// Core memory regions, as exposed by retro_get_memory_data/size or by the
+// SET_MEMORY_MAPS descriptors (used for regions the former does not expose).
+
+typedef struct {
+	std::vector<struct retro_memory_descriptor> descs;
+} memory_map_t;
+
+// Copies the descriptors the core passes to RETRO_ENVIRONMENT_SET_MEMORY_MAPS.
+void memmap_set(memory_map_t *mm, const struct retro_memory_map *map);
+
+// Size of a region (zero if the core does not expose it).
+size_t memory_size(const core_functions_t *core, const memory_map_t *mm, unsigned id);
+
+// Hashes a whole region (RETRO_MEMORY_SYSTEM_RAM, SAVE_RAM or VIDEO_RAM).
+// Returns zero if the core does not expose it at all.
+uint64_t memory_hash(const core_functions_t *core, const memory_map_t *mm, unsigned id);
+
+// Returns a pointer to "len" bytes at "addr" within a region (NULL if out of
+// bounds or unmapped). Regions exposed by retro_get_memory_data are addressed
+// by offset, memory map regions by emulated address (descriptor start, select
+// and disconnect, like cheat and RAM maps do).
+const uint8_t *memory_ptr(const core_functions_t *core, const memory_map_t *mm,
+                          unsigned id, size_t addr, size_t len);
+
+#endif
@@ -5,18 +5,37 @@
 #include <iostream>
 #include <fstream>
 #include <set>
+#include <vector>
 #include <stdio.h>
-#include <stdarg.h>
+#include <string.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <sys/stat.h>
 #include <signal.h>
 #include <math.h>
 #include <chrono>
+#include <algorithm>
 
 #include "argparse.hpp"
 #include "libretro.h"
 #include "util.h"
 #include "loader.h"
+#include "encoder.h"
+#include "fbpool.h"
+#include "audiowriter.h"
+#include "perf.h"
+#include "hwrender.h"
+#include "vfs.h"
+#include "memmap.h"
+#include "watch.h"
+#include "coreopts.h"
+#include "sweep.h"
+#include "logger.h"
+#include "content.h"
+#include "batch.h"
+#include "serve.h"
+#include "scenario.h"
+#include "trie.h"
 
 #ifndef WIN32
   #include <sys/wait.h>
@@ -53,7 +72,6 @@ const std::unordered_map<std::string, unsigned> buttons = {
 	{"r",      RETRO_DEVICE_ID_JOYPAD_R},
 };
 std::unordered_map<unsigned, unsigned> icmds;
-std::unordered_map<std::string, std::string> envvars;
 std::string systemdir;
 std::string outputdir = ".";
 std::string vaapidev;
@@ -61,20 +79,64 @@ std::set<unsigned> shot_ts;
 unsigned frame_counter = 0;
 unsigned shot_every = 0;
 unsigned save_dump_every = 0;
+
+// Per-frame events, compiled from the input and dump arguments before running
+enum {
+	EV_SCREENSHOT = 1,
+	EV_SAVESTATE  = 2,
+};
+typedef struct {
+	uint32_t buttons;    // Joypad buttons pressed during the frame
+	uint32_t actions;    // EV_* flags
+} frame_events_t;
+std::vector<frame_events_t> timeline;
+frame_events_t curr_events = {0, 0};    // Events for the frame being run
+// Tell the core to skip video/audio generation when we do not need it
+bool skip_av = false;
+unsigned encode_threads = 2;
 enum retro_pixel_format videofmt = RETRO_PIXEL_FORMAT_0RGB1555;
 struct retro_system_av_info avinfo;
 pid_t ffpidv = 0;
+bool rawvideo = false;
+unsigned rawvideo_w, rawvideo_h;
 int ffpipev[2] = {0};
 pid_t ffpida = 0;
 int ffpipea[2] = {0};
+// Per-frame fingerprint log (video, audio and optionally RAM hashes)
+typedef struct {
+	uint64_t audio, sysram, saveram;
+} fp_entry_t;
+FILE *fpfile = NULL;
+bool fp_ram = false;
+uint64_t fp_video = 0;
+bool fp_pending = false;         // Entry waiting for its (HW) video hash
+fp_entry_t fp_pending_entry;
+core_functions_t *retrofns = NULL;
+memory_map_t memmap;
+content_t content;
+// Memory watches, evaluated before every frame
+std::vector<mem_watch_t> watches;
+unsigned watch_actions = 0;      // All the actions the watches can trigger
+// Audio samples (stereo frames) produced during the current frame
+scratch_buffer_t audiobuf = {0};
+size_t audio_frames = 0;
+// Frontend-owned buffers, reused across frames (sized by resolution and state size)
+scratch_buffer_t framebuf = {0}, statebuf = {0};
 
-void RETRO_CALLCONV logging_callback(enum retro_log_level level, const char *fmt, ...) {
-	va_list args;
-	va_start(args, fmt);
-	vprintf(fmt, args);
-    va_end(args);
+// Returns the RETRO_ENVIRONMENT_GET_AUDIO_VIDEO_ENABLE flags for the current frame
+int frame_av_flags() {
+	if (!skip_av)
+		return 3;
+	int flags = 0;
+	if (ffpidv || fpfile || (curr_events.actions & EV_SCREENSHOT))
+		flags |= 1;
+	if (ffpida || fpfile)
+		flags |= 2;
+	return flags;
 }
 
+void hw_frame(const void *data, unsigned width, unsigned height, size_t pitch, unsigned frame, uint32_t actions);
+
 bool RETRO_CALLCONV env_callback(unsigned cmd, void *data) {
 	struct retro_variable *rvars = (struct retro_variable*)data;
 
@@ -83,11 +145,27 @@ bool RETRO_CALLCONV env_callback(unsigned cmd, void *data) {
 		videofmt = *(enum retro_pixel_format*)data;
 		return true;
 	case RETRO_ENVIRONMENT_GET_VARIABLE:
-		if (envvars.count(rvars->key)) {
-			rvars->value = envvars.at(rvars->key).c_str();
-			return true;
-		}
-		return false;
+		return coreopts_get(rvars);
+	case RETRO_ENVIRONMENT_SET_VARIABLE:
+		return coreopts_set(rvars);
+	case RETRO_ENVIRONMENT_SET_VARIABLES:
+		coreopts_define_variables(rvars);
+		return true;
+	case RETRO_ENVIRONMENT_GET_CORE_OPTIONS_VERSION:
+		*(unsigned*)data = COREOPTS_VERSION;
+		return true;
+	case RETRO_ENVIRONMENT_SET_CORE_OPTIONS:
+		coreopts_define((const struct retro_core_option_definition*)data);
+		return true;
+	case RETRO_ENVIRONMENT_SET_CORE_OPTIONS_INTL:
+		coreopts_define(((const struct retro_core_options_intl*)data)->us);
+		return true;
+	case RETRO_ENVIRONMENT_SET_CORE_OPTIONS_V2:
+		coreopts_define_v2((const struct retro_core_options_v2*)data);
+		return true;
+	case RETRO_ENVIRONMENT_SET_CORE_OPTIONS_V2_INTL:
+		coreopts_define_v2(((const struct retro_core_options_v2_intl*)data)->us);
+		return true;
 	case RETRO_ENVIRONMENT_GET_SYSTEM_DIRECTORY:
 	case RETRO_ENVIRONMENT_GET_SAVE_DIRECTORY:
 		*((const char**)data) = systemdir.c_str();
@@ -95,9 +173,58 @@ bool RETRO_CALLCONV env_callback(unsigned cmd, void *data) {
 	case RETRO_ENVIRONMENT_SET_MINIMUM_AUDIO_LATENCY:
 		return true;
 	case RETRO_ENVIRONMENT_GET_VARIABLE_UPDATE:
-		return false;
+		*(bool*)data = coreopts_updated();
+		return true;
+	case RETRO_ENVIRONMENT_GET_AUDIO_VIDEO_ENABLE:
+		*(int*)data = frame_av_flags();
+		return true;
+	case RETRO_ENVIRONMENT_GET_FASTFORWARDING:
+		*(bool*)data = skip_av;
+		return true;
+	case RETRO_ENVIRONMENT_GET_THROTTLE_STATE:
+		// We never throttle, in skip mode we behave like a fast-forward
+		((struct retro_throttle_state*)data)->mode = skip_av ? RETRO_THROTTLE_FAST_FORWARD : RETRO_THROTTLE_UNBLOCKED;
+		((struct retro_throttle_state*)data)->rate = 0.0f;
+		return true;
+	case RETRO_ENVIRONMENT_GET_INPUT_BITMASKS:
+		// We can return all the joypad buttons at once (RETRO_DEVICE_ID_JOYPAD_MASK)
+		if (data)
+			*(bool*)data = true;
+		return true;
 	case RETRO_ENVIRONMENT_GET_LOG_INTERFACE:
-		((struct retro_log_callback*)data)->log = &logging_callback;
+		((struct retro_log_callback*)data)->log = &log_callback;
+		return true;
+	case RETRO_ENVIRONMENT_GET_CURRENT_SOFTWARE_FRAMEBUFFER: {
+		// Let the core render straight into one of our (aligned) buffers
+		struct retro_framebuffer *rfb = (struct retro_framebuffer*)data;
+		frame_buffer_t *fb = fbpool_get(rfb->width, rfb->height, videofmt);
+		if (!fb)
+			return false;
+		rfb->data = fb->data;
+		rfb->pitch = fb->pitch;
+		rfb->format = videofmt;
+		rfb->memory_flags = RETRO_MEMORY_TYPE_CACHED;
+		return true;
+	}
+	case RETRO_ENVIRONMENT_SET_HW_RENDER:
+		return hw_render_setup((struct retro_hw_render_callback*)data, &hw_frame);
+	case RETRO_ENVIRONMENT_GET_PREFERRED_HW_RENDER:
+		*(unsigned*)data = RETRO_HW_CONTEXT_OPENGL;
+		return true;
+	case RETRO_ENVIRONMENT_SET_CONTENT_INFO_OVERRIDE:
+		if (data)
+			content_set_overrides((const struct retro_system_content_info_override*)data);
+		return true;
+	case RETRO_ENVIRONMENT_GET_GAME_INFO_EXT:
+		*(const struct retro_game_info_ext**)data = &content.info_ext;
+		return true;
+	case RETRO_ENVIRONMENT_SET_MEMORY_MAPS:
+		memmap_set(&memmap, (const struct retro_memory_map*)data);
+		return true;
+	case RETRO_ENVIRONMENT_GET_VFS_INTERFACE:
+		return vfs_get_interface((struct retro_vfs_interface_info*)data);
+	case RETRO_ENVIRONMENT_GET_PERF_INTERFACE:
+		perf_get_interface((struct retro_perf_callback*)data);
 		return true;
 	case RETRO_ENVIRONMENT_GET_MESSAGE_INTERFACE_VERSION:
 		*((unsigned*)data) = 1;
@@ -111,38 +238,111 @@ bool RETRO_CALLCONV env_callback(unsigned cmd, void *data) {
 	}
 }
 
+// Handles a finished frame (screenshots, video dump and fingerprints)
+void process_frame(const void *data, unsigned width, unsigned height, size_t pitch,
+                   enum retro_pixel_format fmt, unsigned frame, uint32_t actions) {
+	frame_buffer_t *fb = fbpool_lookup(data);
+	if (actions & EV_SCREENSHOT) {
+		char filename[PATH_MAX];
+		sprintf(filename, "%s/screenshot%06u.png", outputdir.c_str(), frame);
+		if (encode_threads)
+			encoder_submit(data, width, height, pitch, fmt, filename, fb);
+		else
+			dump_image(data, width, height, pitch, fmt, filename, &framebuf);
+	}
+	if (fpfile)
+		fp_video = hash_image(data, width, height, pitch, fmt, &framebuf);
+	if (ffpidv) {
+		if (rawvideo)
+			dump_raw_frame(data, width, height, pitch, fmt, rawvideo_w, rawvideo_h, ffpipev[1], &framebuf);
+		else
+			dump_image(data, width, height, pitch, fmt, ffpipev[1], &framebuf);
+	}
+}
+
+// HW rendered frames are read back as XRGB8888, one frame late
+void hw_frame(const void *data, unsigned width, unsigned height, size_t pitch, unsigned frame, uint32_t actions) {
+	process_frame(data, width, height, pitch, RETRO_PIXEL_FORMAT_XRGB8888, frame, actions);
+}
+
 void RETRO_CALLCONV video_update(const void *data, unsigned width, unsigned height, size_t pitch) {
+	if (data == RETRO_HW_FRAME_BUFFER_VALID) {
+		if (ffpidv || fpfile || (curr_events.actions & EV_SCREENSHOT))
+			hw_render_readback(width, height, frame_counter, curr_events.actions);
+		return;
+	}
 	if (!data)
 		return;
 
-	if ((shot_every && (frame_counter % shot_every) == 0) || shot_ts.count(frame_counter)) {
-		char filename[PATH_MAX];
-		sprintf(filename, "%s/screenshot%06u.png", outputdir.c_str(), frame_counter);
-		dump_image(data, width, height, pitch, videofmt, filename);
-	}
-	if (ffpidv)
-		dump_image(data, width, height, pitch, videofmt, ffpipev[1]);
+	process_frame(data, width, height, pitch, videofmt, frame_counter, curr_events.actions);
 }
 
 void RETRO_CALLCONV input_poll() {
 	// Do nothing for now
 }
 
+void audio_append(const int16_t *data, size_t frames) {
+	int16_t *buf = (int16_t*)scratch_reserve(&audiobuf, (audio_frames + frames) * 2 * sizeof(int16_t));
+	memcpy(&buf[audio_frames * 2], data, frames * 2 * sizeof(int16_t));
+	audio_frames += frames;
+}
+
+void fingerprint_log(unsigned frame, const fp_entry_t *e) {
+	// Frames without video (dupes) keep the previous hash
+	fprintf(fpfile, "%u %016llx %016llx", frame,
+	        (unsigned long long)fp_video, (unsigned long long)e->audio);
+	if (fp_ram)
+		fprintf(fpfile, " %016llx %016llx", (unsigned long long)e->sysram,
+		        (unsigned long long)e->saveram);
+	fputc('\n', fpfile);
+}
+
+void fingerprint_flush() {
+	if (fp_pending)
+		fingerprint_log(frame_counter - 1, &fp_pending_entry);
+	fp_pending = false;
+}
+
+// Called at the end of every frame, queues all the accumulated samples at once.
+void audio_flush() {
+	size_t bytes = audio_frames * 2 * sizeof(int16_t);
+	if (ffpida)
+		audio_writer_push(audiobuf.data, bytes);
+	if (fpfile) {
+		fp_entry_t e = { hash64(audiobuf.data, bytes, 0), 0, 0 };
+		if (fp_ram) {
+			e.sysram = memory_hash(retrofns, &memmap, RETRO_MEMORY_SYSTEM_RAM);
+			e.saveram = memory_hash(retrofns, &memmap, RETRO_MEMORY_SAVE_RAM);
+		}
+		if (hw_render_enabled()) {
+			// The video hash arrives one frame late, so does the log entry
+			fingerprint_flush();
+			fp_pending = true;
+			fp_pending_entry = e;
+		}
+		else
+			fingerprint_log(frame_counter, &e);
+	}
+	audio_frames = 0;
+}
+
 void RETRO_CALLCONV single_sample(int16_t left, int16_t right) {
-	if (ffpida) {
+	if (ffpida || fpfile) {
 		int16_t buf[2] = {left, right};
-		write(ffpipea[1], buf, sizeof(buf));
+		audio_append(buf, 1);
 	}
 }
 
 size_t RETRO_CALLCONV audio_buffer(const int16_t *data, size_t frames) {
-	if (ffpida)
-		write(ffpipea[1], data, frames*2*sizeof(int16_t));
+	if (ffpida || fpfile)
+		audio_append(data, frames);
 	return frames;
 }
 
 int16_t RETRO_CALLCONV input_state(unsigned port, unsigned device, unsigned index, unsigned id) {
-	if (icmds.count(frame_counter) && (icmds.at(frame_counter) & (1 << id)))
+	if (device == RETRO_DEVICE_JOYPAD && id == RETRO_DEVICE_ID_JOYPAD_MASK)
+		return curr_events.buttons;
+	if (curr_events.buttons & (1 << id))
 		return 1;
 	// No input for now
 	return 0;
@@ -162,9 +362,75 @@ void parse_input(std::string entry) {
 	}
 }
 
+// Resolves all the per-frame inputs and actions, so that the frame loop and
+// the callbacks only need to look at the current frame entry.
+void build_timeline(unsigned maxframes) {
+	timeline.assign(maxframes, {0, 0});
+	for (auto & it : icmds)
+		if (it.first < maxframes)
+			timeline[it.first].buttons = it.second;
+	for (auto f : shot_ts)
+		if (f < maxframes)
+			timeline[f].actions |= EV_SCREENSHOT;
+	for (unsigned f = 0; f < maxframes; f++) {
+		if (shot_every && (f % shot_every) == 0)
+			timeline[f].actions |= EV_SCREENSHOT;
+		if (save_dump_every && (f % save_dump_every) == 0)
+			timeline[f].actions |= EV_SAVESTATE;
+	}
+}
+
+// Core log file of a forked process: same name, in its own outputdir. If that
+// is the parent's log file (same directory) the child logs to stdout instead,
+// reopening it would truncate the parent's log.
+std::string forked_logfile(const std::string &logfile) {
+	if (logfile.empty())
+		return "";
+	std::string fn = outputdir + "/" + logfile.substr(logfile.rfind('/') + 1);
+	struct stat a, b;
+	if (!stat(fn.c_str(), &a) && !stat(logfile.c_str(), &b) && a.st_dev == b.st_dev && a.st_ino == b.st_ino)
+		return "";
+	return fn;
+}
+
+// Sets up a process forked in the middle of a run: its own log writer and
+// encoder threads, and a copy of the fingerprint log so far (in outputdir).
+// The core log (if it goes to a file) is reopened in outputdir too.
+bool forked_run_setup(const std::string &logfile, std::string *fppath, unsigned encode_queue, bool encode_drop) {
+	std::string logfn = forked_logfile(logfile);
+	if (!log_fork_child(logfn)) {
+		std::cerr << "Could not open log file " << logfn << std::endl;
+		return false;
+	}
+	if (encode_threads)
+		encoder_start(encode_threads, encode_queue, encode_drop);
+	if (fpfile) {
+		std::string fn = outputdir + "/" + fppath->substr(fppath->rfind('/') + 1);
+		FILE *src = fopen(fppath->c_str(), "r"), *dst = fopen(fn.c_str(), "w");
+		if (!src || !dst) {
+			std::cerr << "Could not open fingerprint file " << fn << std::endl;
+			return false;
+		}
+		char buf[4096];
+		size_t n;
+		while ((n = fread(buf, 1, sizeof(buf), src)) > 0)
+			fwrite(buf, 1, n, dst);
+		fclose(src);
+		fclose(fpfile);
+		fpfile = dst;
+		*fppath = fn;
+	}
+	return true;
+}
+
 int main(int argc, char **argv) {
+	// Startup latency is measured from here (or from the job request)
+	auto launch_time = std::chrono::steady_clock::now();
+
 	// Set up alarm handler to ensure we can abort
 	set_sighdlr(SIGALRM, alarmhandler);
+	// A dead ffmpeg should make writes fail, not kill us
+	set_sighdlr(SIGPIPE, SIG_IGN);
 
 	argparse::ArgumentParser parser;
 
@@ -190,9 +456,26 @@ int main(int argc, char **argv) {
 	parser.addArgument("--image-scale", 1);
 	// Dumps a frame every N frames
 	parser.addArgument("--dump-frames-every", 1);
+	// Number of framebuffers handed out to the core (0 disables it)
+	parser.addArgument("--fb-pool", 1);
+	// Screenshot encoding threads (0 encodes synchronously) and queue size
+	parser.addArgument("--encode-threads", 1);
+	parser.addArgument("--encode-queue", 1);
+	// Drop screenshots instead of stalling the core when the queue is full
+	parser.addArgument("--encode-drop", '*');
 	// Generates a video/audio from the video/audio streams
 	parser.addArgument("--dump-video", 1);
 	parser.addArgument("--dump-audio", 1);
+	// Size (in KiB) of the ring buffer that feeds the audio writer thread
+	parser.addArgument("--audio-ring-size", 1);
+	// Writes a per-frame video/audio hash log (for image-free comparisons)
+	parser.addArgument("--fingerprint", 1);
+	// Adds system RAM and save RAM hashes to the fingerprint log
+	parser.addArgument("--fingerprint-ram", '*');
+	// Let the core skip video/audio on frames where we do not use them
+	parser.addArgument("--skip-av", '*');
+	// Pipe the native pixel format to ffmpeg (rawvideo) instead of BMP images
+	parser.addArgument("--raw-video", '*');
 	// Instruct ffmpeg to use VAAPI encoding, much faster :)
 	parser.addArgument("--use-vaapi-device", 1);
 
@@ -206,9 +489,47 @@ int main(int argc, char **argv) {
 	parser.addArgument("-i", "--input", 1);
 	parser.addArgument("--input-channel", 1);
 
+	// Prefault the (mmap'ed) ROM at load time
+	parser.addArgument("--populate-rom", '*');
+
+	// Memory watches that stop the run or take screenshots/savestates
+	parser.addArgument("--watch", 1);
+
 	// Retro read variables passed here
 	parser.addArgument("--envvar", '*');
 
+	// Core logging: minimum level (debug, info, warn, error), max messages
+	// per call site and frame, and output file (.gz to compress it)
+	parser.addArgument("--log-level", 1);
+	parser.addArgument("--log-rate", 1);
+	parser.addArgument("--log-file", 1);
+
+	// Writes the time (in nanoseconds) that every frame took
+	parser.addArgument("--frame-times", 1);
+
+	// Benchmarks the given core options (one process per combination)
+	parser.addArgument("--sweep", 1);
+	parser.addArgument("--sweep-jobs", 1);
+	parser.addArgument("--sweep-max", 1);
+
+	// The ROM is a list (file or directory), forks a worker for every ROM
+	parser.addArgument("--batch", '*');
+	parser.addArgument("--batch-jobs", 1);
+	parser.addArgument("--batch-timeout", 1);
+	parser.addArgument("--batch-mem", 1);
+
+	// Fork server: forks a child per job requested through this Unix socket
+	parser.addArgument("--serve", 1);
+	parser.addArgument("--serve-jobs", 1);
+
+	// Input scenarios (one --input script per line) forked from the same boot
+	parser.addArgument("--scenarios", 1);
+	parser.addArgument("--fork-at", 1);
+	parser.addArgument("--scenario-jobs", 1);
+	// Runs the scenarios as a trie, forking wherever their input diverges
+	// (one child at a time, --scenario-jobs is ignored)
+	parser.addArgument("--scenario-trie", '*');
+
 
 	// TODO: dump other stuff
 
@@ -234,6 +555,11 @@ int main(int argc, char **argv) {
 	}
 	if (parser.gotArgument("dump-frames-every"))
 		shot_every = parser.retrieve<unsigned>("dump-frames-every");
+	unsigned encode_queue = 8;
+	if (parser.gotArgument("encode-threads"))
+		encode_threads = parser.retrieve<unsigned>("encode-threads");
+	if (parser.gotArgument("encode-queue"))
+		encode_queue = parser.retrieve<unsigned>("encode-queue");
 	if (parser.gotArgument("dump-savestates-every"))
 		save_dump_every = parser.retrieve<unsigned>("dump-savestates-every");
 	if (parser.gotArgument("load-savestate"))
@@ -259,18 +585,108 @@ int main(int argc, char **argv) {
 			parse_input(entry);
 	}
 
+	std::string fppath;
+	if (parser.gotArgument("fingerprint"))
+		fppath = parser.retrieve<std::string>("fingerprint");
+
+	if (parser.gotArgument("watch")) {
+		std::istringstream spr(parser.retrieve<std::string>("watch"));
+		std::string entry;
+		while (spr >> entry) {
+			mem_watch_t w;
+			if (!watch_parse(entry, &w)) {
+				std::cerr << "Invalid watch expression " << entry << std::endl;
+				return 1;
+			}
+			watches.push_back(w);
+			watch_actions |= w.action;
+		}
+	}
+
+	std::vector<std::string> scenarios;
+	unsigned fork_at = 0;
+	if (parser.gotArgument("scenarios")) {
+		scenarios = scenario_load(parser.retrieve<std::string>("scenarios"));
+		if (scenarios.empty()) {
+			std::cerr << "No input scenarios found" << std::endl;
+			return 1;
+		}
+		if (parser.gotArgument("dump-video") || parser.gotArgument("dump-audio")) {
+			std::cerr << "Input scenarios cannot be combined with video/audio dumps" << std::endl;
+			return 1;
+		}
+		// By default fork right before the scenarios diverge
+		fork_at = scenario_first_frame(scenarios);
+		if (parser.gotArgument("fork-at")) {
+			fork_at = parser.retrieve<unsigned>("fork-at");
+			if (fork_at > scenario_first_frame(scenarios))
+				std::cerr << "Scenario input before frame " << fork_at << " will be ignored" << std::endl;
+		}
+	}
+
+	std::vector<std::string> vars;
 	if (parser.gotArgument("envvar")) {
-		std::vector<std::string> vars = parser.retrieve<std::vector<std::string>>("envvar");
+		vars = parser.retrieve<std::vector<std::string>>("envvar");
 		for (auto & var : vars) {
 			auto p = var.find('=');
 			if (p != std::string::npos)
-				envvars[var.substr(0, p)] = var.substr(p+1);
+				coreopts_override(var.substr(0, p), var.substr(p+1));
+		}
+	}
+
+	enum retro_log_level loglevel = RETRO_LOG_DEBUG;
+	if (parser.gotArgument("log-level")) {
+		const std::string lvl = parser.retrieve<std::string>("log-level");
+		const char *names[] = {"debug", "info", "warn", "error"};
+		unsigned i = 0;
+		while (i < 4 && lvl != names[i])
+			i++;
+		if (i == 4) {
+			std::cerr << "Invalid log level " << lvl << " (debug, info, warn or error)" << std::endl;
+			return 1;
 		}
+		loglevel = (enum retro_log_level)i;
+	}
+	unsigned lograte = 0;
+	if (parser.gotArgument("log-rate"))
+		lograte = parser.retrieve<unsigned>("log-rate");
+	std::string logfile;
+	if (parser.gotArgument("log-file"))
+		logfile = parser.retrieve<std::string>("log-file");
+	if (!log_start(loglevel, lograte, logfile)) {
+		std::cerr << "Could not open log file " << logfile << std::endl;
+		return 1;
+	}
+	if (!logfile.empty()) {
+		// Forked workers may change directory
+		char *rp = realpath(logfile.c_str(), NULL);
+		if (rp)
+			logfile = rp;
+		free(rp);
+	}
+
+	// Batch workers run in their own output directory
+	bool batch = parser.gotArgument("batch");
+	if (batch) {
+		for (auto p : {&systemdir, &statefile}) {
+			char *rp = p->empty() ? NULL : realpath(p->c_str(), NULL);
+			if (rp)
+				*p = rp;
+			free(rp);
+		}
+	}
+
+	if (!scenarios.empty() && fork_at >= maxframes) {
+		std::cerr << "Cannot fork the scenarios at frame " << fork_at << ", the run is "
+		          << maxframes << " frames long" << std::endl;
+		return 1;
 	}
 
 	bool use_alarm = !parser.gotArgument("no-alarm");
+	skip_av = parser.gotArgument("skip-av");
+	build_timeline(maxframes);
 
-	core_functions_t *retrofns = load_core(corefile.c_str());
+	retrofns = load_core(corefile.c_str());
 	if (!retrofns) {
 		std::cerr << "Could not load " << corefile << std::endl;
 		return 1;
@@ -291,34 +707,138 @@ int main(int argc, char **argv) {
 	retrofns->core_set_input_poll_function(&input_poll);
 	retrofns->core_set_input_state_function(&input_state);
 
+	unsigned fbpool_size = 4;
+	if (parser.gotArgument("fb-pool"))
+		fbpool_size = parser.retrieve<unsigned>("fb-pool");
+	fbpool_init(fbpool_size);
+	vfs_init(systemdir);
+
 	// Call init now
 	retrofns->core_init();
 
+	// From here on the batch parent just forks workers, that continue as
+	// if they had been started for that single ROM.
+	if (batch) {
+		batch_opts_t bopts = {(unsigned)sysconf(_SC_NPROCESSORS_ONLN), 0, 0};
+		if (parser.gotArgument("batch-jobs"))
+			bopts.jobs = std::max(1U, parser.retrieve<unsigned>("batch-jobs"));
+		if (parser.gotArgument("batch-timeout"))
+			bopts.timeout = parser.retrieve<unsigned>("batch-timeout");
+		if (parser.gotArgument("batch-mem"))
+			bopts.memlimit = parser.retrieve<unsigned long>("batch-mem");
+		std::vector<std::string> roms = batch_roms(rom_file);
+		if (!batch_run(roms, outputdir, bopts, &rom_file)) {
+			retrofns->core_deinit();
+			vfs_deinit();
+			return 0;
+		}
+		outputdir = ".";
+		std::string logfn = forked_logfile(logfile);
+		if (!log_fork_child(logfn)) {
+			std::cerr << "Could not open log file " << logfn << std::endl;
+			return 1;
+		}
+	}
+	else if (parser.gotArgument("serve")) {
+		unsigned jobs = sysconf(_SC_NPROCESSORS_ONLN);
+		if (parser.gotArgument("serve-jobs"))
+			jobs = std::max(1U, parser.retrieve<unsigned>("serve-jobs"));
+		serve_job_t job;
+		if (!serve_run(parser.retrieve<std::string>("serve"), jobs, &job)) {
+			retrofns->core_deinit();
+			vfs_deinit();
+			return 0;
+		}
+
+		// Job parameters replace the command line ones
+		launch_time = job.accepted;
+		const auto &p = job.params;
+		if (p.count("rom"))
+			rom_file = p.at("rom");
+		if (p.count("output")) {
+			outputdir = p.at("output");
+			mkdir(outputdir.c_str(), 0755);
+		}
+		if (p.count("frames"))
+			maxframes = atoi(p.at("frames").c_str());
+		if (p.count("dump-frames")) {
+			shot_ts.clear();
+			std::istringstream spr(p.at("dump-frames"));
+			unsigned f;
+			while (spr >> f)
+				shot_ts.insert(f);
+		}
+		if (p.count("dump-frames-every"))
+			shot_every = atoi(p.at("dump-frames-every").c_str());
+		if (p.count("input")) {
+			icmds.clear();
+			std::istringstream spr(p.at("input"));
+			std::string entry;
+			while (spr >> entry)
+				parse_input(entry);
+		}
+		if (p.count("fingerprint"))
+			fppath = p.at("fingerprint");
+		build_timeline(maxframes);
+		std::string logfn = forked_logfile(logfile);
+		if (!log_fork_child(logfn)) {
+			std::cerr << "Could not open log file " << logfn << std::endl;
+			return 1;
+		}
+	}
+
 	// Init the core and load the ROM
 	std::cout << "Loading ROM " << rom_file << std::endl;
-	struct retro_game_info gameinfo = {.path = rom_file.c_str(), .data = NULL, .size = 0, .meta = NULL};
-	void *dptr = NULL;
-	if (!info.need_fullpath) {
-		FILE *fd = fopen(rom_file.c_str(), "rb");
-		fseek(fd, 0, SEEK_END);
-		gameinfo.size = ftell(fd);
-		fseek(fd, 0, SEEK_SET);
-		dptr = malloc(gameinfo.size);
-		fread(dptr, 1, gameinfo.size, fd);
-		fclose(fd);
+	if (!content_open(&content, rom_file, &info, parser.gotArgument("populate-rom"))) {
+		std::cerr << "Could not open ROM " << rom_file << std::endl;
+		return 1;
 	}
-	gameinfo.data = dptr;
 
-	if (!retrofns->core_load_game(&gameinfo)) {
+	if (!retrofns->core_load_game(&content.info)) {
 		std::cout << "Failed to load the game, retro_load_game returned false!" << std::endl;
 		return -1;
 	}
-	retrofns->core_reset();
 	retrofns->core_get_system_av_info(&avinfo);
+	if (hw_render_enabled() && !hw_render_init(avinfo.geometry.max_width, avinfo.geometry.max_height))
+		return -1;
+	retrofns->core_reset();
+
+	// The core declared its options by now, the sweep runs happen in children
+	if (parser.gotArgument("sweep")) {
+		// Drop the arguments the sweep sets per run (or would clash between runs)
+		const std::set<std::string> dropped = {
+			"-o", "--output", "--fingerprint", "--frame-times", "--dump-video", "--dump-audio",
+			"--sweep", "--sweep-jobs", "--sweep-max", "--envvar" };
+		std::vector<std::string> args;
+		for (int i = 0; i < argc; i++) {
+			if (!dropped.count(argv[i]))
+				args.push_back(argv[i]);
+			else if (!strcmp(argv[i], "--envvar"))
+				while (i + 1 < argc && argv[i+1][0] != '-')
+					i++;
+			else
+				i++;
+		}
+		unsigned jobs = sysconf(_SC_NPROCESSORS_ONLN);
+		if (parser.gotArgument("sweep-jobs"))
+			jobs = std::max(1U, parser.retrieve<unsigned>("sweep-jobs"));
+		unsigned maxcombs = 256;
+		if (parser.gotArgument("sweep-max"))
+			maxcombs = parser.retrieve<unsigned>("sweep-max");
+
+		int ret = sweep_run(parser.retrieve<std::string>("sweep"), jobs, maxcombs, args, vars, outputdir);
+		hw_render_deinit();
+		retrofns->core_unload_game();
+		retrofns->core_deinit();
+		return ret;
+	}
 
 	#ifndef WIN32
 	if (parser.gotArgument("dump-video")) {
 		std::string videop = parser.retrieve<std::string>("dump-video");
+		rawvideo = parser.gotArgument("raw-video");
+		rawvideo_w = avinfo.geometry.base_width;
+		rawvideo_h = avinfo.geometry.base_height;
 		pipe(ffpipev);
 		ffpidv = fork();
 		if (ffpidv) {
@@ -335,28 +855,36 @@ int main(int argc, char **argv) {
 			if (scalf > 1)
 				filter += ",scale=iw*" + std::to_string(scalf) + ":ih*" + std::to_string(scalf);
 
-			if (vaapidev.empty()) {
-				execlp("ffmpeg", "ffmpeg", "-nostats",
-					"-f", "image2pipe",
-					"-framerate", std::to_string(avinfo.timing.fps).c_str(),
-					"-i", "-",
-					"-vf", filter.c_str(),
-					"-tune", "animation",
-					"-c:v", "libx264", "-crf", "12",
-					videop.c_str(), NULL);
-			} else {
+			// Raw mode feeds the native pixels, otherwise we send a stream of BMP images
+			std::vector<std::string> inargs = {"-f", "image2pipe"};
+			// HW rendered frames are always read back as XRGB8888
+			enum retro_pixel_format rawfmt = hw_render_enabled() ? RETRO_PIXEL_FORMAT_XRGB8888 : videofmt;
+			if (rawvideo)
+				inargs = {"-f", "rawvideo", "-pix_fmt", ffmpeg_pixfmt(rawfmt),
+				          "-video_size", std::to_string(rawvideo_w) + "x" + std::to_string(rawvideo_h)};
+
+			std::vector<std::string> ffargs = {"ffmpeg", "-nostats"};
+			if (!vaapidev.empty()) {
 				filter += ",format=nv12,hwupload";
-				execlp("ffmpeg", "ffmpeg", "-nostats",
-					"-vaapi_device", vaapidev.c_str(),
-					"-f", "image2pipe",
-					"-framerate", std::to_string(avinfo.timing.fps).c_str(),
-					"-i", "-",
-					"-vf", filter.c_str(),
-					"-tune", "animation",
-					"-c:v", "h264_vaapi", "-qp", "18",
-					"-b:v", (std::to_string(kbps) + "k").c_str(),
-					videop.c_str(), NULL);
+				ffargs.insert(ffargs.end(), {"-vaapi_device", vaapidev});
 			}
+			ffargs.insert(ffargs.end(), inargs.begin(), inargs.end());
+			ffargs.insert(ffargs.end(), {
+				"-framerate", std::to_string(avinfo.timing.fps),
+				"-i", "-",
+				"-vf", filter,
+				"-tune", "animation"});
+			if (vaapidev.empty())
+				ffargs.insert(ffargs.end(), {"-c:v", "libx264", "-crf", "12"});
+			else
+				ffargs.insert(ffargs.end(), {"-c:v", "h264_vaapi", "-qp", "18", "-b:v", std::to_string(kbps) + "k"});
+			ffargs.push_back(videop);
+
+			std::vector<char*> argp;
+			for (auto & a : ffargs)
+				argp.push_back((char*)a.c_str());
+			argp.push_back(NULL);
+			execvp("ffmpeg", argp.data());
 		}
 	}
 
@@ -366,6 +894,10 @@ int main(int argc, char **argv) {
 		ffpida = fork();
 		if (ffpida) {
 			close(ffpipea[0]);
+			unsigned ringkb = 1024;
+			if (parser.gotArgument("audio-ring-size"))
+				ringkb = parser.retrieve<unsigned>("audio-ring-size");
+			audio_writer_start(ffpipea[1], ringkb * 1024);
 		}
 		else {
 			close(ffpipea[1]);
@@ -399,38 +931,242 @@ int main(int argc, char **argv) {
 		free(serstate);
 	}
 
+	if (!fppath.empty()) {
+		fpfile = fopen(fppath.c_str(), "w");
+		if (!fpfile) {
+			std::cerr << "Could not open fingerprint file " << fppath << std::endl;
+			return 1;
+		}
+		fp_ram = parser.gotArgument("fingerprint-ram");
+		if (fp_ram && !memory_size(retrofns, &memmap, RETRO_MEMORY_SYSTEM_RAM) &&
+		    !memory_size(retrofns, &memmap, RETRO_MEMORY_SAVE_RAM))
+			std::cerr << "Warning: the core exposes no system or save RAM, RAM hashes will be zero" << std::endl;
+	}
+
+	// No need for encoding threads if we are not taking screenshots
+	if (!shot_every && shot_ts.empty() && !(watch_actions & WATCH_SCREENSHOT))
+		encode_threads = 0;
+	if (encode_threads)
+		encoder_start(encode_threads, encode_queue, parser.gotArgument("encode-drop"));
+
+	// The state size is queried once, the buffer is reused for every dump
+	size_t sersz = (save_dump_every || (watch_actions & WATCH_SAVESTATE)) ?
+	               retrofns->core_serialize_size() : 0;
+
+	if (!scenarios.empty() && hw_render_enabled()) {
+		std::cerr << "Input scenarios are not supported with HW rendered cores" << std::endl;
+		return 1;
+	}
+	std::vector<std::vector<uint32_t>> trie_buttons;
+	if (!scenarios.empty() && parser.gotArgument("scenario-trie")) {
+		// Per-frame input of every scenario, on top of the shared input
+		auto base = icmds;
+		for (auto &sc : scenarios) {
+			icmds = base;
+			std::istringstream spr(sc);
+			std::string entry;
+			while (spr >> entry)
+				parse_input(entry);
+			build_timeline(maxframes);
+			std::vector<uint32_t> b;
+			for (auto &ev : timeline)
+				b.push_back(ev.buttons);
+			trie_buttons.push_back(b);
+		}
+		icmds = base;
+		std::string fpname = fppath.empty() ? "" : fppath.substr(fppath.rfind('/') + 1);
+		std::set<std::string> nolink;
+		if (!fpname.empty())
+			nolink.insert(fpname);
+		if (!logfile.empty())
+			nolink.insert(logfile.substr(logfile.rfind('/') + 1));
+		outputdir = trie_init(trie_buttons, outputdir, nolink, &frame_counter);
+		if (fpfile) {
+			// The root fingerprint log lives in its node directory too
+			std::string fn = outputdir + "/" + fpname;
+			if (rename(fppath.c_str(), fn.c_str())) {
+				fclose(fpfile);
+				unlink(fppath.c_str());
+				fpfile = fopen(fn.c_str(), "w");
+				if (!fpfile) {
+					std::cerr << "Could not open fingerprint file " << fn << std::endl;
+					return 1;
+				}
+			}
+			fppath = fn;
+		}
+		for (unsigned f = 0; f < maxframes; f++)
+			timeline[f].buttons = trie_buttons[0][f];
+		scenarios.clear();
+	}
+	unsigned scenario_jobs = sysconf(_SC_NPROCESSORS_ONLN);
+	if (parser.gotArgument("scenario-jobs"))
+		scenario_jobs = std::max(1U, parser.retrieve<unsigned>("scenario-jobs"));
+
+	unsigned video_skipped = 0, audio_skipped = 0;
+	std::vector<uint64_t> frametimes;
+	bool log_frametimes = parser.gotArgument("frame-times");
+	if (log_frametimes)
+		frametimes.reserve(maxframes);
+	std::vector<const mem_watch_t*> fired;
+	bool stop = false;
 	auto start_time = std::chrono::high_resolution_clock::now();
+	uint64_t startup_us = std::chrono::duration_cast<std::chrono::microseconds>(
+		std::chrono::steady_clock::now() - launch_time).count();
+	std::cout << "Startup latency " << startup_us << " microseconds" << std::endl;
+	serve_job_started(startup_us);
 	while (frame_counter < maxframes) {
+		if (!scenarios.empty() && frame_counter == fork_at) {
+			// Encoder threads do not survive fork()
+			if (encode_threads)
+				encoder_stop();
+			if (fpfile)
+				fflush(fpfile);
+			double boot_secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - launch_time).count();
+			unsigned failed = 0;
+			int sc = scenario_fork(scenarios, scenario_jobs, outputdir, frame_counter, boot_secs, &outputdir, &failed);
+			if (sc < 0) {
+				// The parent is done once the report is out
+				retrofns->core_unload_game();
+				retrofns->core_deinit();
+				vfs_deinit();
+				content_close(&content);
+				if (fpfile)
+					fclose(fpfile);
+				return failed ? 1 : 0;
+			}
+
+			// The shared input stays up to here, the scenario provides the rest
+			for (auto it = icmds.begin(); it != icmds.end(); )
+				it = (it->first >= frame_counter) ? icmds.erase(it) : std::next(it);
+			std::istringstream spr(scenarios[sc]);
+			std::string entry;
+			while (spr >> entry)
+				parse_input(entry);
+			scenarios.clear();
+			build_timeline(maxframes);
+
+			if (!forked_run_setup(logfile, &fppath, encode_queue, parser.gotArgument("encode-drop")))
+				return 1;
+		}
+		else if (!trie_buttons.empty() && trie_diverges(frame_counter)) {
+			if (encode_threads)
+				encoder_stop();
+			if (fpfile)
+				fflush(fpfile);
+			int sc = trie_branch(frame_counter, &outputdir);
+			if (sc < 0)
+				break;
+			for (unsigned f = 0; f < maxframes; f++)
+				timeline[f].buttons = trie_buttons[sc][f];
+			if (!forked_run_setup(logfile, &fppath, encode_queue, parser.gotArgument("encode-drop")))
+				return 1;
+		}
+
+		auto frame_start = std::chrono::high_resolution_clock::now();
 		if (use_alarm)
 			set_alarm(frametimeout);
+		curr_events = timeline[frame_counter];
+		if (!watches.empty()) {
+			// Watches see the memory as the previous frame left it, and
+			// their actions apply to the frame that is about to run.
+			fired.clear();
+			unsigned wa = watch_eval(watches, retrofns, &memmap, &fired);
+			for (auto w : fired)
+				std::cout << "Watch " << w->expr << " triggered at frame " << frame_counter << std::endl;
+			curr_events.actions |= (wa & WATCH_SCREENSHOT) ? EV_SCREENSHOT : 0;
+			curr_events.actions |= (wa & WATCH_SAVESTATE) ? EV_SAVESTATE : 0;
+			stop = (wa & WATCH_STOP);
+		}
+		if (skip_av) {
+			int avflags = frame_av_flags();
+			video_skipped += (avflags & 1) ? 0 : 1;
+			audio_skipped += (avflags & 2) ? 0 : 1;
+		}
 		retrofns->core_run();
 
-		if (save_dump_every && (frame_counter % save_dump_every) == 0) {
+		if (curr_events.actions & EV_SAVESTATE) {
 			char filename[PATH_MAX];
 			sprintf(filename, "%s/state%06u.bin", outputdir.c_str(), frame_counter);
-			size_t sersz = retrofns->core_serialize_size();
-			void *serstate = malloc(sersz);
+			void *serstate = scratch_reserve(&statebuf, sersz);
 			retrofns->core_serialize(serstate, sersz);
 			FILE *fd = fopen(filename, "wb");
 			if (fd) {
 				fwrite(serstate, 1, sersz, fd);
 				fclose(fd);
 			}
-			free(serstate);
 		}
+		hw_render_end_frame();
+		audio_flush();
+		coreopts_end_frame();
+		log_end_frame();
 		frame_counter++;
+		if (log_frametimes)
+			frametimes.push_back(std::chrono::duration_cast<std::chrono::nanoseconds>(
+				std::chrono::high_resolution_clock::now() - frame_start).count());
+		if (stop) {
+			std::cout << "Run stopped by a memory watch after " << frame_counter << " frames" << std::endl;
+			break;
+		}
 	}
 	auto end_time = std::chrono::high_resolution_clock::now();
 	auto dnano = std::chrono::duration_cast<std::chrono::nanoseconds>(end_time-start_time).count();
 
+	// Any HW frame still in flight
+	hw_render_flush();
+	if (fpfile)
+		fingerprint_flush();
+
+	if (log_frametimes) {
+		std::ofstream ofd(parser.retrieve<std::string>("frame-times"));
+		for (auto t : frametimes)
+			ofd << t << "\n";
+	}
+
 	std::cout << "Total execution time " << dnano << " nanoseconds" << std::endl;
+	std::cout << "Average speed " << (dnano ? frame_counter * 1e9 / dnano : 0) << " fps" << std::endl;
+	perf_report(std::cout);
+	vfs_report(std::cout);
+	coreopts_report(std::cout);
+	log_report(std::cout);
+	if (skip_av)
+		std::cout << "Video disabled in " << video_skipped << " frames, audio disabled in " << audio_skipped << " frames" << std::endl;
 
+	// Draining the encoders might take a while
 	set_alarm(0);
+	if (encode_threads) {
+		encoder_stop();
+		encoder_stats_t est = encoder_stats();
+		std::cout << "Screenshot encoder: " << est.submitted << " queued, " << est.dropped << " dropped, ";
+		std::cout << "max depth " << est.max_depth << "/" << est.capacity << ", blocked ";
+		std::cout << est.blocked << " times (" << est.blocked_ns << " nanoseconds)" << std::endl;
+	}
+	if (ffpida) {
+		audio_writer_stop();
+		audio_writer_stats_t ast = audio_writer_stats();
+		std::cout << "Audio writer: blocked " << ast.blocked << " times (" << ast.blocked_ns << " nanoseconds), ";
+		std::cout << "max fill " << ast.max_fill << "/" << ast.capacity << " bytes" << std::endl;
+		if (ast.failed)
+			std::cerr << "Audio dump failed, some samples were not written" << std::endl;
+	}
+	std::cout << "Frontend buffer allocations " << scratch_allocations() << std::endl;
+	std::cout << "Frames rendered into frontend framebuffers " << fbpool_hits() << std::endl;
+
+	hw_render_deinit();
 	retrofns->core_unload_game();
 	retrofns->core_deinit();
-	if (dptr)
-		free(dptr);
+	vfs_deinit();
+	log_stop();
+	content_close(&content);
 	free(retrofns);
+	if (fpfile)
+		fclose(fpfile);
+	scratch_free(&audiobuf);
+	scratch_free(&framebuf);
+	scratch_free(&statebuf);
+	fbpool_destroy();
+	if (!trie_buttons.empty())
+		trie_finish();
 
 	#ifndef WIN32
 	if (ffpida) {
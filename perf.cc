@@ -0,0 +1,105 @@
+// Copyright 2021 David Guillen Fandos <david@davidgf.net>
+// Released under the GPL2 license
+
+#include <time.h>
+#include <iostream>
+#include <mutex>
+#include <vector>
+#include "perf.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+  #include <x86intrin.h>
+  #define PERF_X86
+  #define PERF_TICK_UNIT "cycles"
+#else
+  #define PERF_TICK_UNIT "ns"
+#endif
+
+// Cores may register counters from their own threads
+static std::vector<struct retro_perf_counter*> counters;
+static std::mutex counters_mutex;
+
+static retro_time_t RETRO_CALLCONV perf_get_time_usec() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (retro_time_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static retro_perf_tick_t RETRO_CALLCONV perf_get_counter() {
+	#ifdef PERF_X86
+	return __rdtsc();
+	#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (retro_perf_tick_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+	#endif
+}
+
+static uint64_t RETRO_CALLCONV perf_get_cpu_features() {
+	uint64_t feat = 0;
+	#ifdef PERF_X86
+	__builtin_cpu_init();
+	feat |= __builtin_cpu_supports("cmov")   ? RETRO_SIMD_CMOV   : 0;
+	feat |= __builtin_cpu_supports("mmx")    ? RETRO_SIMD_MMX    : 0;
+	feat |= __builtin_cpu_supports("sse")    ? RETRO_SIMD_SSE    : 0;
+	feat |= __builtin_cpu_supports("sse2")   ? RETRO_SIMD_SSE2   : 0;
+	feat |= __builtin_cpu_supports("sse3")   ? RETRO_SIMD_SSE3   : 0;
+	feat |= __builtin_cpu_supports("ssse3")  ? RETRO_SIMD_SSSE3  : 0;
+	feat |= __builtin_cpu_supports("sse4.1") ? RETRO_SIMD_SSE4   : 0;
+	feat |= __builtin_cpu_supports("sse4.2") ? RETRO_SIMD_SSE42  : 0;
+	feat |= __builtin_cpu_supports("popcnt") ? RETRO_SIMD_POPCNT : 0;
+	feat |= __builtin_cpu_supports("aes")    ? RETRO_SIMD_AES    : 0;
+	feat |= __builtin_cpu_supports("avx")    ? RETRO_SIMD_AVX    : 0;
+	feat |= __builtin_cpu_supports("avx2")   ? RETRO_SIMD_AVX2   : 0;
+	#elif defined(__aarch64__)
+	feat |= RETRO_SIMD_NEON | RETRO_SIMD_ASIMD;
+	#elif defined(__ARM_NEON)
+	feat |= RETRO_SIMD_NEON;
+	#endif
+	return feat;
+}
+
+static void RETRO_CALLCONV perf_register(struct retro_perf_counter *counter) {
+	std::lock_guard<std::mutex> g(counters_mutex);
+	if (counter->registered)
+		return;
+	counter->registered = true;
+	counters.push_back(counter);
+}
+
+static void RETRO_CALLCONV perf_start(struct retro_perf_counter *counter) {
+	counter->start = perf_get_counter();
+}
+
+static void RETRO_CALLCONV perf_stop(struct retro_perf_counter *counter) {
+	counter->total += perf_get_counter() - counter->start;
+	counter->call_cnt++;
+}
+
+static void RETRO_CALLCONV perf_log() {
+	perf_report(std::cout);
+}
+
+void perf_get_interface(struct retro_perf_callback *cb) {
+	cb->get_time_usec = &perf_get_time_usec;
+	cb->get_cpu_features = &perf_get_cpu_features;
+	cb->get_perf_counter = &perf_get_counter;
+	cb->perf_register = &perf_register;
+	cb->perf_start = &perf_start;
+	cb->perf_stop = &perf_stop;
+	cb->perf_log = &perf_log;
+}
+
+void perf_report(std::ostream &os) {
+	std::vector<struct retro_perf_counter*> snapshot;
+	{
+		std::lock_guard<std::mutex> g(counters_mutex);
+		snapshot = counters;
+	}
+	for (auto c : snapshot) {
+		os << "Perf counter " << (c->ident ? c->ident : "(null)") << ": total " << c->total << " " PERF_TICK_UNIT;
+		os << ", " << c->call_cnt << " calls, average ";
+		os << (c->call_cnt ? c->total / c->call_cnt : 0) << " " PERF_TICK_UNIT << std::endl;
+	}
+}
+
@@ -0,0 +1,18 @@
+// Copyright 2021 David Guillen Fandos <david@davidgf.net>
+// Released under the GPL2 license
+
+#ifndef _PERF_H__
+#define _PERF_H__
+
+#include <ostream>
+#include "libretro.h"
+
+// Frontend side of the libretro performance interface (GET_PERF_INTERFACE).
+// Counters registered by the core are tracked so we can dump them at the end.
+
+void perf_get_interface(struct retro_perf_callback *cb);
+
+// Prints all the counters registered by the core (total, calls and average).
+void perf_report(std::ostream &os);
+
+#endif
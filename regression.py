@@ -23,6 +23,9 @@ parser.add_argument('--frames', dest='frames', type=int, default=3200, help='Fra
 parser.add_argument('--capture', dest='capture', type=int, default=1, help='Number of frames to capture')
 parser.add_argument('--random-capture', dest='randomcapture', type=int, default=0, help='Number of pseudo-random frames to capture')
 parser.add_argument('--record', dest='record', action="store_true", help='Record video and audio')
+parser.add_argument('--raw-video', dest='rawvideo', action="store_true", help='Record raw frames at the base geometry (faster, crops size changes)')
+parser.add_argument('--fingerprint', dest='fingerprint', action="store_true", help='Log per-frame video/audio hashes')
+parser.add_argument('--fingerprint-ram', dest='fingerprintram', action="store_true", help='Also log per-frame system/save RAM hashes')
 parser.add_argument('--threads', dest='threads', type=int, default=8, help='CPUs (threads) to use')
 parser.add_argument('--input', dest='infiles', nargs='+', help='Set of files or directories to use as test files')
 parser.add_argument('--output', dest='output', required=True, help='Output report file (either .txt or .html)')
@@ -73,6 +76,12 @@ def runcore(rom):
       "--dump-video", vfile,
       "--dump-audio", afile,
     ]
+    if args.rawvideo:
+      eargs += ["--raw-video"]
+  if args.fingerprint or args.fingerprintram:
+    eargs += ["--fingerprint", os.path.join(opath, "fingerprint.log")]
+  if args.fingerprintram:
+    eargs += ["--fingerprint-ram"]
   if args.randomcapture:
     eargs += ["--dump-frames"] + [str(x % args.frames) for x in rndnums(seed, args.randomcapture)]
 
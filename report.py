@@ -35,6 +35,25 @@ args = parser.parse_args()
 
 t = Template(open("report.html", "r").read())
 
+def read_fingerprint(path):
+  # Per-frame (frame, (video hash, audio hash[, sysram hash, saveram hash]))
+  # entries, as generated by --fingerprint (and --fingerprint-ram)
+  fpfile = os.path.join(path, "fingerprint.log")
+  if not os.path.exists(fpfile):
+    return None
+  with open(fpfile) as fd:
+    return [(int(f[0]), tuple(f[1:])) for f in (l.split() for l in fd) if f]
+
+def first_mismatch(fplogs):
+  # Returns the first frame (as logged) where the fingerprint logs diverge, or
+  # None. Only the columns all the logs have are compared (with/without RAM).
+  ncols = min((len(h) for log in fplogs for _, h in log), default=0)
+  logs = [dict((f, h[:ncols]) for f, h in log) for log in fplogs]
+  for frame in sorted(set().union(*logs)):
+    if len(set(log.get(frame) for log in logs)) > 1:
+      return frame
+  return None
+
 def read_results(path):
   resjfile = os.path.join(path, "results.json")
   if not os.path.exists(resjfile):
@@ -51,6 +70,7 @@ def read_results(path):
   for name, e in romres["images"].items():
     e["hash"] = hashlib.sha256(e["data"]).digest()
   romres["imagehashes"] = b"".join(sorted(x["hash"] for x in romres["images"].values()))
+  romres["fingerprint"] = read_fingerprint(path)
   return romres
   
 
@@ -88,10 +108,13 @@ elif args.subparser == "compare":
     romname = [r["rom"] for r in results if r][0]
     differ = len(set([r["imagehashes"] for r in results if r])) > 1
     differ = differ or len(set([r["exitcode"] for r in results if r])) > 1
+    fplogs = [r["fingerprint"] for r in results if r and r["fingerprint"] is not None]
+    fpdiff = first_mismatch(fplogs) if len(fplogs) > 1 else None
+    differ = differ or fpdiff is not None
     difcnt += 1 if differ else 0
 
     if not args.onlydiff or differ:
-      allresults.append({"rom": romname, "results": results, "imgdiff": differ})
+      allresults.append({"rom": romname, "results": results, "imgdiff": differ, "fpdiff": fpdiff})
 
   if args.onlydiffimg:
     for romres in allresults:
@@ -0,0 +1,120 @@
+// Copyright 2021 David Guillen Fandos <david@davidgf.net>
+// Released under the GPL2 license
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <chrono>
+#include <algorithm>
+#include "scenario.h"
+#include "logger.h"
+
+typedef struct {
+	pid_t pid;
+	int exitcode;
+	std::chrono::steady_clock::time_point start;
+	double runtime;
+} scenario_job_t;
+
+std::vector<std::string> scenario_load(const std::string &fn) {
+	std::vector<std::string> ret;
+	std::ifstream ifd(fn);
+	std::string l;
+	while (std::getline(ifd, l))
+		if (l.find_first_not_of(" \t") != std::string::npos)
+			ret.push_back(l);
+	return ret;
+}
+
+unsigned scenario_first_frame(const std::vector<std::string> &scenarios) {
+	unsigned first = ~0U;
+	for (auto &s : scenarios) {
+		std::istringstream spr(s);
+		std::string entry;
+		while (spr >> entry)
+			first = std::min(first, (unsigned)atoi(entry.c_str()));
+	}
+	return first == ~0U ? 0 : first;
+}
+
+// Makespan of running the jobs (in order) on "jobs" slots
+static double makespan(const std::vector<double> &times, unsigned jobs) {
+	std::vector<double> slots(std::min((size_t)jobs, times.size()), 0.0);
+	for (auto t : times)
+		*std::min_element(slots.begin(), slots.end()) += t;
+	return slots.empty() ? 0 : *std::max_element(slots.begin(), slots.end());
+}
+
+int scenario_fork(const std::vector<std::string> &scenarios, unsigned jobs, const std::string &outdir,
+                  unsigned boot_frames, double boot_secs, std::string *dir, unsigned *failed) {
+	std::cout << "Forking " << scenarios.size() << " scenarios at frame " << boot_frames
+	          << ", " << jobs << " at a time" << std::endl;
+
+	auto fork_start = std::chrono::steady_clock::now();
+	std::vector<scenario_job_t> sjobs(scenarios.size());
+	unsigned next = 0, running = 0;
+	while (next < sjobs.size() || running) {
+		while (next < sjobs.size() && running < jobs) {
+			char dn[32];
+			sprintf(dn, "/scenario%03u", next);
+			std::string d = outdir + dn;
+			mkdir(d.c_str(), 0755);
+
+			std::cout << std::flush;
+			fflush(NULL);
+			log_fork_prepare();
+			scenario_job_t &j = sjobs[next];
+			j.start = std::chrono::steady_clock::now();
+			j.exitcode = -1;
+			j.runtime = 0;
+			j.pid = fork();
+			if (!j.pid) {
+				int fd = open((d + "/output.log").c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+				if (fd >= 0) {
+					dup2(fd, STDOUT_FILENO);
+					dup2(fd, STDERR_FILENO);
+					close(fd);
+				}
+				*dir = d;
+				return next;
+			}
+			next++;
+			running += (j.pid > 0) ? 1 : 0;
+		}
+		int status;
+		pid_t pid = waitpid(-1, &status, 0);
+		if (pid < 0)
+			break;
+		for (auto &j : sjobs) {
+			if (j.pid == pid) {
+				j.exitcode = WIFEXITED(status) ? WEXITSTATUS(status) : -WTERMSIG(status);
+				j.runtime = std::chrono::duration<double>(std::chrono::steady_clock::now() - j.start).count();
+			}
+		}
+		running--;
+	}
+	double fanout_secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - fork_start).count();
+
+	printf("%8s %6s %10s  %s\n", "scenario", "exit", "time (s)", "input");
+	std::vector<double> indep;
+	*failed = 0;
+	for (unsigned i = 0; i < sjobs.size(); i++) {
+		printf("%8u %6d %10.3f  %s\n", i, sjobs[i].exitcode, sjobs[i].runtime, scenarios[i].c_str());
+		indep.push_back(boot_secs + sjobs[i].runtime);
+		*failed += sjobs[i].exitcode ? 1 : 0;
+	}
+
+	// Independent runs would boot every time, estimate how long they'd take
+	double actual = boot_secs + fanout_secs, estimated = makespan(indep, jobs);
+	printf("Boot (%u frames) took %.3f s, scenarios took %.3f s, %.3f s in total\n",
+	       boot_frames, boot_secs, fanout_secs, actual);
+	printf("Independent runs would take about %.3f s, %.3f s saved (%.1f%%)\n",
+	       estimated, estimated - actual, estimated > 0 ? 100 * (estimated - actual) / estimated : 0);
+	return -1;
+}
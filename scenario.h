@@ -0,0 +1,30 @@
+// Copyright 2021 David Guillen Fandos <david@davidgf.net>
+// Released under the GPL2 license
+
+#ifndef _SCENARIO_H__
+#define _SCENARIO_H__
+
+#include <string>
+#include <vector>
+
+// Input scenarios: many runs of the same game that only differ in their
+// input. The game boots once, and at the fork frame the process forks a child
+// per scenario, all of them sharing the booted state copy-on-write. Every
+// child writes to its own "<outdir>/scenarioNNN" directory (with its output
+// in output.log).
+
+// Loads the scenarios, one --input style script per line.
+std::vector<std::string> scenario_load(const std::string &fn);
+
+// Returns the first frame with input in any scenario (where they diverge).
+unsigned scenario_first_frame(const std::vector<std::string> &scenarios);
+
+// Works like fork(): returns the scenario index in the child (with "dir" set
+// to its output directory). The parent waits for all of them (running "jobs"
+// at a time), reports the time saved compared to independent runs (given the
+// time it took to boot) and returns -1, with the number of scenarios that
+// failed (non-zero exit code) in "failed".
+int scenario_fork(const std::vector<std::string> &scenarios, unsigned jobs, const std::string &outdir,
+                  unsigned boot_frames, double boot_secs, std::string *dir, unsigned *failed);
+
+#endif
@@ -0,0 +1,263 @@
+// Copyright 2021 David Guillen Fandos <david@davidgf.net>
+// Released under the GPL2 license
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <limits.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <iostream>
+#include <set>
+#include <vector>
+#include "serve.h"
+#include "logger.h"
+#include "util.h"
+
+typedef struct {
+	unsigned id;
+	pid_t pid;
+	int conn;          // Client connection
+	int started;       // Pipe the child reports its startup latency through
+	std::string rom;
+	std::chrono::steady_clock::time_point accepted;
+} serve_slot_t;
+
+typedef struct {
+	int conn;
+	std::string req;   // Request read so far
+	std::chrono::steady_clock::time_point accepted;
+} serve_pending_t;
+
+static const std::set<std::string> job_keys = {
+	"rom", "output", "frames", "dump-frames", "dump-frames-every", "input", "fingerprint" };
+
+// Clients get this long to send their request before being dropped
+static const int request_timeout_ms = 5000;
+
+static int sigpipe[2] = {-1, -1};     // SIGCHLD/SIGTERM self-pipe
+static volatile sig_atomic_t quit = 0;
+static int started_fd = -1;           // Only valid in job children
+
+static void sighandler(int sig) {
+	if (sig != SIGCHLD)
+		quit = 1;
+	int e = errno;
+	if (write(sigpipe[1], "", 1) < 0) {}
+	errno = e;
+}
+
+static void reply(int fd, const std::string &msg) {
+	write_all(fd, msg.data(), msg.size());
+}
+
+static bool parse_count(const std::string &v, bool allow_zero) {
+	char *end;
+	errno = 0;
+	unsigned long n = strtoul(v.c_str(), &end, 10);
+	return !v.empty() && isdigit((unsigned char)v[0]) && !*end && !errno &&
+	       n <= UINT_MAX && (n || allow_zero);
+}
+
+// Parses a complete request, returns false (replying with the error) if it is invalid
+static bool parse_job(int fd, const std::string &req, serve_job_t *job) {
+	size_t pos = 0;
+	while (pos < req.size()) {
+		size_t eol = req.find('\n', pos);
+		std::string l = req.substr(pos, eol == std::string::npos ? std::string::npos : eol - pos);
+		pos = eol == std::string::npos ? req.size() : eol + 1;
+		if (l.empty())
+			break;
+		auto p = l.find('=');
+		std::string key = l.substr(0, p);
+		if (p == std::string::npos || !job_keys.count(key)) {
+			reply(fd, "Invalid job parameter " + l + "\n");
+			return false;
+		}
+		std::string val = l.substr(p + 1);
+		if ((key == "frames" && !parse_count(val, false)) ||
+		    (key == "dump-frames-every" && !parse_count(val, true))) {
+			reply(fd, "Invalid job parameter value " + l + "\n");
+			return false;
+		}
+		job->params[key] = val;
+	}
+	return true;
+}
+
+bool serve_run(const std::string &sockpath, unsigned jobs, serve_job_t *job) {
+	int lfd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	struct sockaddr_un addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if (lfd < 0 || sockpath.size() >= sizeof(addr.sun_path)) {
+		std::cerr << "Invalid socket path " << sockpath << std::endl;
+		return false;
+	}
+	strcpy(addr.sun_path, sockpath.c_str());
+	unlink(sockpath.c_str());
+	if (bind(lfd, (struct sockaddr*)&addr, sizeof(addr)) || listen(lfd, 64)) {
+		std::cerr << "Could not listen on " << sockpath << ": " << strerror(errno) << std::endl;
+		close(lfd);
+		return false;
+	}
+
+	if (pipe2(sigpipe, O_CLOEXEC | O_NONBLOCK))
+		return false;
+	struct sigaction sa;
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = sighandler;
+	sigaction(SIGCHLD, &sa, NULL);
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+	std::cout << "Serving jobs on " << sockpath << ", " << jobs << " at a time" << std::endl;
+
+	std::vector<serve_slot_t> running;
+	std::vector<serve_pending_t> pending;
+	unsigned jobcnt = 0, nstarted = 0;
+	uint64_t total_latency = 0;
+	while (!quit || !running.empty()) {
+		// Requests are read as they arrive, a slow client only holds its own slot
+		std::vector<struct pollfd> pfds = {{sigpipe[0], POLLIN, 0}, {lfd, POLLIN, 0}};
+		bool accepting = !quit && running.size() + pending.size() < jobs;
+		if (!accepting)
+			pfds[1].events = 0;
+		int timeout = -1;
+		auto now = std::chrono::steady_clock::now();
+		for (auto &c : pending) {
+			pfds.push_back({c.conn, POLLIN, 0});
+			int left = request_timeout_ms - std::chrono::duration_cast<std::chrono::milliseconds>(now - c.accepted).count();
+			timeout = std::max(0, timeout < 0 ? left : std::min(timeout, left));
+		}
+		if (poll(pfds.data(), pfds.size(), timeout) < 0 && errno != EINTR)
+			break;
+		char tmp[64];
+		while (read(sigpipe[0], tmp, sizeof(tmp)) > 0);
+
+		// Reap finished jobs and report back to their clients
+		int status;
+		pid_t pid;
+		while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+			for (auto it = running.begin(); it != running.end(); ++it) {
+				if (it->pid != pid)
+					continue;
+				uint64_t latency = 0;
+				bool started = read(it->started, &latency, sizeof(latency)) == sizeof(latency);
+				int exitcode = WIFEXITED(status) ? WEXITSTATUS(status) : -WTERMSIG(status);
+				double runtime = std::chrono::duration<double>(std::chrono::steady_clock::now() - it->accepted).count();
+				total_latency += latency;
+				nstarted += started ? 1 : 0;
+
+				reply(it->conn, "Job exit code " + std::to_string(exitcode) + ", startup latency " +
+				                (started ? std::to_string(latency) : "-") + " microseconds\n");
+				std::cout << "Job " << it->id << " (" << it->rom << "): exit code " << exitcode
+				          << ", startup latency " << (started ? std::to_string(latency) : "-")
+				          << " us, " << runtime << " s total" << std::endl;
+				close(it->conn);
+				close(it->started);
+				running.erase(it);
+				break;
+			}
+		}
+
+		if (accepting && (pfds[1].revents & POLLIN)) {
+			int conn = accept4(lfd, NULL, NULL, SOCK_CLOEXEC | SOCK_NONBLOCK);
+			if (conn >= 0)
+				pending.push_back({conn, "", std::chrono::steady_clock::now()});
+		}
+
+		// Read whatever the pending clients sent, start the complete requests
+		now = std::chrono::steady_clock::now();
+		for (size_t i = 0; i < pending.size(); ) {
+			serve_pending_t &c = pending[i];
+			bool eof = false;
+			char buf[4096];
+			ssize_t r;
+			while ((r = read(c.conn, buf, sizeof(buf))) > 0)
+				c.req.append(buf, r);
+			if (!r || (r < 0 && errno != EAGAIN && errno != EINTR))
+				eof = true;
+
+			bool complete = c.req.find("\n\n") != std::string::npos;
+			if (!complete && !eof && !quit && now - c.accepted < std::chrono::milliseconds(request_timeout_ms)) {
+				i++;
+				continue;
+			}
+			serve_pending_t p = c;
+			pending.erase(pending.begin() + i);
+
+			// Incomplete requests are dropped, the job output is written blocking
+			serve_job_t j;
+			j.accepted = p.accepted;
+			int spipe[2];
+			if (!complete || quit || fcntl(p.conn, F_SETFL, 0) ||
+			    !parse_job(p.conn, p.req, &j) || pipe2(spipe, O_CLOEXEC | O_NONBLOCK)) {
+				close(p.conn);
+				continue;
+			}
+
+			std::cout << std::flush;
+			fflush(NULL);
+			log_fork_prepare();
+			pid = fork();
+			if (!pid) {
+				// The child only keeps its own connection
+				struct sigaction dfl;
+				memset(&dfl, 0, sizeof(dfl));
+				dfl.sa_handler = SIG_DFL;
+				sigaction(SIGCHLD, &dfl, NULL);
+				sigaction(SIGINT, &dfl, NULL);
+				sigaction(SIGTERM, &dfl, NULL);
+				close(lfd);
+				close(sigpipe[0]);
+				close(sigpipe[1]);
+				for (auto &s : running) {
+					close(s.conn);
+					close(s.started);
+				}
+				for (auto &s : pending)
+					close(s.conn);
+				close(spipe[0]);
+				started_fd = spipe[1];
+				dup2(p.conn, STDOUT_FILENO);
+				dup2(p.conn, STDERR_FILENO);
+				close(p.conn);
+				*job = j;
+				return true;
+			}
+			close(spipe[1]);
+			if (pid < 0) {
+				reply(p.conn, "Could not fork the job\n");
+				close(p.conn);
+				close(spipe[0]);
+				continue;
+			}
+			jobcnt++;
+			running.push_back({jobcnt, pid, p.conn, spipe[0], j.params.count("rom") ? j.params["rom"] : "default ROM", j.accepted});
+		}
+	}
+
+	for (auto &c : pending)
+		close(c.conn);
+	close(lfd);
+	unlink(sockpath.c_str());
+	std::cout << "Served " << jobcnt << " jobs, average startup latency "
+	          << (nstarted ? total_latency / nstarted : 0) << " us" << std::endl;
+	return false;
+}
+
+void serve_job_started(uint64_t latency_us) {
+	if (started_fd < 0)
+		return;
+	write_all(started_fd, &latency_us, sizeof(latency_us));
+	close(started_fd);
+	started_fd = -1;
+}
@@ -0,0 +1,43 @@
+// Copyright 2021 David Guillen Fandos <david@davidgf.net>
+// Released under the GPL2 license
+
+#ifndef _SERVE_H__
+#define _SERVE_H__
+
+#include <map>
+#include <string>
+#include <chrono>
+
+// Fork server: keeps a loaded and initialized core around and forks a child
+// per job from it, skipping the dlopen/relocation/core_init cost (which is
+// huge under qemu-user). Jobs are requested through a Unix socket, a client
+// sends "key=value" lines followed by an empty line:
+//   rom=<path>                 ROM to run (defaults to the -r one)
+//   output=<dir>               Output directory (defaults to the -o one)
+//   frames=<n>                 Number of frames to run (n > 0)
+//   dump-frames=<n n ...>      Frames to take screenshots at
+//   dump-frames-every=<n>      Screenshot every n frames (0 disables it)
+//   input=<frame:button ...>   Input events (like --input)
+//   fingerprint=<path>         Per-frame hash log (like --fingerprint)
+// The job output (stdout and stderr) is streamed back through the socket and
+// a final "Job exit code <n>, startup latency <us> microseconds" line closes it.
+// Requests are read without blocking the server, clients that do not finish
+// theirs within 5 seconds are dropped.
+// With --log-file, a job writes its core log (same file name) in its output
+// directory, or to the client if that is where the server's own log lives.
+
+typedef struct {
+	std::map<std::string, std::string> params;
+	std::chrono::steady_clock::time_point accepted;
+} serve_job_t;
+
+// Works like fork(): returns true in the job child (with "job" filled and
+// stdout/stderr redirected to the client). The server returns false once it
+// is asked to stop (SIGINT/SIGTERM) and the running jobs are done.
+bool serve_run(const std::string &sockpath, unsigned jobs, serve_job_t *job);
+
+// Called by the job once it is about to run the first frame, reports the
+// time it took to get there since the request was received.
+void serve_job_started(uint64_t latency_us);
+
+#endif
@@ -0,0 +1,228 @@
+// Copyright 2021 David Guillen Fandos <david@davidgf.net>
+// Released under the GPL2 license
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+#include <map>
+#include "sweep.h"
+#include "coreopts.h"
+
+typedef struct {
+	std::vector<std::string> overrides;    // key=value entries
+	std::string dir;
+	pid_t pid;
+	int status;
+} sweep_job_t;
+
+static pid_t spawn(const std::vector<std::string> &args, const std::string &logfile) {
+	pid_t pid = fork();
+	if (pid)
+		return pid;
+
+	int fd = open(logfile.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd >= 0) {
+		dup2(fd, STDOUT_FILENO);
+		dup2(fd, STDERR_FILENO);
+		close(fd);
+	}
+	std::vector<char*> argv;
+	for (auto &a : args)
+		argv.push_back((char*)a.c_str());
+	argv.push_back(NULL);
+	execv("/proc/self/exe", argv.data());
+	_exit(127);
+}
+
+static std::vector<uint64_t> read_frametimes(const std::string &fn) {
+	std::vector<uint64_t> ret;
+	std::ifstream ifd(fn);
+	uint64_t ns;
+	while (ifd >> ns)
+		ret.push_back(ns);
+	return ret;
+}
+
+static std::vector<std::string> read_lines(const std::string &fn) {
+	std::vector<std::string> ret;
+	std::ifstream ifd(fn);
+	std::string l;
+	while (std::getline(ifd, l))
+		ret.push_back(l);
+	return ret;
+}
+
+// Compares two fingerprint logs, returns the first differing frame (as logged)
+// or -1
+static long first_mismatch(const std::vector<std::string> &a, const std::vector<std::string> &b) {
+	size_t n = std::min(a.size(), b.size());
+	for (size_t i = 0; i < n; i++)
+		if (a[i] != b[i])
+			return atol(a[i].c_str());
+	if (a.size() == b.size())
+		return -1;
+	return atol((a.size() > n ? a : b)[n].c_str());
+}
+
+static double percentile_ms(const std::vector<uint64_t> &sorted, double q) {
+	size_t idx = std::min(sorted.size() - 1, (size_t)(q * sorted.size()));
+	return sorted[idx] / 1e6;
+}
+
+int sweep_run(const std::string &spec, unsigned jobs, unsigned maxcombs,
+              const std::vector<std::string> &args, const std::vector<std::string> &envvars,
+              const std::string &outdir) {
+	// Resolve the options and values to sweep
+	std::vector<std::string> keys;
+	std::map<std::string, std::vector<std::string>> subsets;
+	std::istringstream spr(spec);
+	std::string entry;
+	while (spr >> entry) {
+		if (entry == "all") {
+			for (auto &k : coreopts_declared())
+				if (!subsets.count(k))
+					keys.push_back(k);
+			continue;
+		}
+		auto p = entry.find('=');
+		std::string key = entry.substr(0, p);
+		if (p != std::string::npos) {
+			std::istringstream vpr(entry.substr(p + 1));
+			std::string v;
+			while (std::getline(vpr, v, '|'))
+				subsets[key].push_back(v);
+		}
+		keys.push_back(key);
+	}
+
+	std::vector<std::string> defvals;
+	std::vector<std::vector<std::string>> choices;
+	unsigned long ncombs = 1;
+	for (auto &k : keys) {
+		std::string defval;
+		std::vector<std::string> c;
+		if (!coreopts_choices(k, &defval, &c)) {
+			std::cerr << "Option " << k << " is not declared by the core" << std::endl;
+			return 1;
+		}
+		if (subsets.count(k))
+			c = subsets.at(k);
+		if (c.empty()) {
+			std::cerr << "Option " << k << " has no values to sweep" << std::endl;
+			return 1;
+		}
+		defvals.push_back(defval);
+		choices.push_back(c);
+		ncombs *= c.size();
+		if (ncombs > maxcombs) {
+			std::cerr << "Too many option combinations, the limit is " << maxcombs << std::endl;
+			return 1;
+		}
+	}
+
+	// First job runs the defaults, the rest every combination (but that one)
+	std::vector<sweep_job_t> sjobs(1);
+	for (unsigned long n = 0; n < ncombs && !keys.empty(); n++) {
+		sweep_job_t j;
+		unsigned long idx = n;
+		bool isdef = true;
+		for (unsigned i = 0; i < keys.size(); i++) {
+			const std::string &v = choices[i][idx % choices[i].size()];
+			idx /= choices[i].size();
+			isdef &= (v == defvals[i]);
+			j.overrides.push_back(keys[i] + "=" + v);
+		}
+		if (!isdef)
+			sjobs.push_back(j);
+	}
+
+	std::string basedir = outdir + "/sweep";
+	mkdir(basedir.c_str(), 0755);
+	std::cout << "Sweeping " << keys.size() << " options, " << sjobs.size()
+	          << " runs, " << jobs << " at a time" << std::endl;
+
+	// Run them, keeping up to "jobs" processes alive
+	unsigned next = 0, running = 0;
+	while (next < sjobs.size() || running) {
+		while (next < sjobs.size() && running < jobs) {
+			sweep_job_t &j = sjobs[next];
+			char dn[32];
+			sprintf(dn, "/%03u", next);
+			j.dir = basedir + dn;
+			mkdir(j.dir.c_str(), 0755);
+			// Required arguments must come first (argparse restriction)
+			std::vector<std::string> cargs = {args[0], "-o", j.dir};
+			cargs.insert(cargs.end(), args.begin() + 1, args.end());
+			cargs.insert(cargs.end(), {"--fingerprint", j.dir + "/fingerprint.log",
+			                           "--frame-times", j.dir + "/frametimes.log", "--envvar"});
+			cargs.insert(cargs.end(), envvars.begin(), envvars.end());
+			cargs.insert(cargs.end(), j.overrides.begin(), j.overrides.end());
+			j.pid = spawn(cargs, j.dir + "/output.log");
+			j.status = -1;
+			next++;
+			running += (j.pid > 0) ? 1 : 0;
+		}
+		int status;
+		pid_t pid = waitpid(-1, &status, 0);
+		if (pid < 0)
+			break;
+		for (auto &j : sjobs)
+			if (j.pid == pid)
+				j.status = status;
+		running--;
+	}
+
+	// Report, all compared against the first (default) run
+	std::vector<std::string> deffp = read_lines(sjobs[0].dir + "/fingerprint.log");
+	bool defok = WIFEXITED(sjobs[0].status) && !WEXITSTATUS(sjobs[0].status);
+	bool defcmp = defok && !deffp.empty();
+	if (!defcmp)
+		printf("The default run %s (see %s/output.log), output equivalence is not available\n",
+		       defok ? "produced no fingerprint" : "failed", sjobs[0].dir.c_str());
+	printf("%10s %9s %9s %9s  %-16s %s\n", "fps", "p50 ms", "p90 ms", "p99 ms", "output", "options");
+	for (unsigned i = 0; i < sjobs.size(); i++) {
+		const sweep_job_t &j = sjobs[i];
+		std::string opts;
+		for (auto &o : j.overrides)
+			opts += o + " ";
+		for (unsigned k = 0; !i && k < keys.size(); k++)
+			opts += keys[k] + "=" + defvals[k] + " ";
+		if (!WIFEXITED(j.status) || WEXITSTATUS(j.status)) {
+			printf("%10s %9s %9s %9s  %-16s %s\n", "-", "-", "-", "-", "failed", opts.c_str());
+			continue;
+		}
+
+		std::vector<uint64_t> ft = read_frametimes(j.dir + "/frametimes.log");
+		uint64_t total = 0;
+		for (auto t : ft)
+			total += t;
+		std::sort(ft.begin(), ft.end());
+
+		char outcome[32];
+		long mm = first_mismatch(deffp, read_lines(j.dir + "/fingerprint.log"));
+		if (!i)
+			strcpy(outcome, "default");
+		else if (!defcmp)
+			strcpy(outcome, "n/a");
+		else if (mm < 0)
+			strcpy(outcome, "identical");
+		else
+			sprintf(outcome, "differs @%ld", mm);
+
+		if (ft.empty())
+			printf("%10s %9s %9s %9s  %-16s %s\n", "-", "-", "-", "-", outcome, opts.c_str());
+		else
+			printf("%10.1f %9.3f %9.3f %9.3f  %-16s %s\n", total ? ft.size() * 1e9 / total : 0,
+			       percentile_ms(ft, 0.5), percentile_ms(ft, 0.9), percentile_ms(ft, 0.99),
+			       outcome, opts.c_str());
+	}
+	return 0;
+}
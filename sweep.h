@@ -0,0 +1,21 @@
+// Copyright 2021 David Guillen Fandos <david@davidgf.net>
+// Released under the GPL2 license
+
+#ifndef _SWEEP_H__
+#define _SWEEP_H__
+
+#include <string>
+#include <vector>
+
+// Core option sweep: runs the same ROM once per combination of core option
+// values, each in its own miniretro process (this binary re-executed with
+// "args" plus the option overrides), "jobs" of them at a time. Prints the
+// throughput, frame time percentiles and whether the output (fingerprint)
+// matches the run with default options (not available if that one failed).
+// "spec" is a space separated list of "key" (sweeps all the declared values),
+// "key=v1|v2" (only those values) or "all" (every declared option).
+int sweep_run(const std::string &spec, unsigned jobs, unsigned maxcombs,
+              const std::vector<std::string> &args, const std::vector<std::string> &envvars,
+              const std::string &outdir);
+
+#endif
@@ -0,0 +1,169 @@
+// Copyright 2021 David Guillen Fandos <david@davidgf.net>
+// Released under the GPL2 license
+
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <atomic>
+#include <iostream>
+#include <map>
+#include <set>
+#include <new>
+#include "trie.h"
+#include "logger.h"
+
+typedef struct {
+	std::vector<std::vector<uint32_t>> buttons;
+	std::vector<unsigned> group;       // Scenarios run by this process
+	std::string outdir, dir;
+	std::set<std::string> nolink;      // Per process files (never shared)
+	unsigned first_frame;              // Frame this process started at
+	const unsigned *frame;             // Current frame (of the run loop)
+	bool root, branched, finished;
+	std::atomic<uint64_t> *emulated;   // Shared by all the processes
+} trie_state_t;
+
+static trie_state_t ts;
+
+static std::string new_node_dir() {
+	std::string d = ts.outdir + "/.trie" + std::to_string(getpid());
+	mkdir(d.c_str(), 0755);
+	return d;
+}
+
+// Hard links every file in "src" into "dst" (except the ones to skip). Files
+// every process writes on its own (fingerprint, core log) are skipped: a link
+// would be truncated and written by both processes.
+static void link_files(const std::string &src, const std::string &dst, bool skiplog) {
+	DIR *d = opendir(src.c_str());
+	if (!d)
+		return;
+	while (struct dirent *e = readdir(d)) {
+		if (e->d_name[0] == '.' || ts.nolink.count(e->d_name))
+			continue;
+		if (skiplog && !strcmp(e->d_name, "output.log"))
+			continue;
+		std::string dn = dst + "/" + e->d_name;
+		unlink(dn.c_str());
+		if (link((src + "/" + e->d_name).c_str(), dn.c_str()))
+			std::cerr << "Could not link " << dn << std::endl;
+	}
+	closedir(d);
+}
+
+static void remove_dir(const std::string &path) {
+	DIR *d = opendir(path.c_str());
+	if (!d)
+		return;
+	while (struct dirent *e = readdir(d))
+		if (strcmp(e->d_name, ".") && strcmp(e->d_name, ".."))
+			unlink((path + "/" + e->d_name).c_str());
+	closedir(d);
+	rmdir(path.c_str());
+}
+
+std::string trie_init(const std::vector<std::vector<uint32_t>> &buttons, const std::string &outdir,
+                      const std::set<std::string> &nolink, const unsigned *frame) {
+	ts.buttons = buttons;
+	ts.frame = frame;
+	ts.finished = false;
+	ts.outdir = outdir;
+	ts.nolink = nolink;
+	ts.first_frame = 0;
+	ts.root = true;
+	ts.branched = false;
+	for (unsigned i = 0; i < buttons.size(); i++)
+		ts.group.push_back(i);
+	void *m = mmap(NULL, sizeof(*ts.emulated), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	ts.emulated = new (m) std::atomic<uint64_t>(0);
+	ts.dir = new_node_dir();
+	// Processes that die early (frame timeouts, errors) still produce their
+	// scenario directories and clean up
+	atexit(trie_finish);
+	return ts.dir;
+}
+
+bool trie_diverges(unsigned frame) {
+	for (auto s : ts.group)
+		if (ts.buttons[s][frame] != ts.buttons[ts.group[0]][frame])
+			return true;
+	return false;
+}
+
+int trie_branch(unsigned frame, std::string *dir) {
+	// Groups of scenarios with the same input at this frame
+	std::map<uint32_t, std::vector<unsigned>> groups;
+	for (auto s : ts.group)
+		groups[ts.buttons[s][frame]].push_back(s);
+
+	ts.branched = true;
+	for (auto &g : groups) {
+		std::cout << std::flush;
+		fflush(NULL);
+		log_fork_prepare();
+		pid_t pid = fork();
+		if (!pid) {
+			std::string parent = ts.dir;
+			ts.dir = new_node_dir();
+			ts.group = g.second;
+			ts.first_frame = frame;
+			ts.root = ts.branched = false;
+			int fd = open((ts.dir + "/output.log").c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+			if (fd >= 0) {
+				dup2(fd, STDOUT_FILENO);
+				dup2(fd, STDERR_FILENO);
+				close(fd);
+			}
+			link_files(parent, ts.dir, true);
+			*dir = ts.dir;
+			return ts.group[0];
+		}
+		if (pid < 0)
+			std::cerr << "Could not fork at frame " << frame << std::endl;
+		else
+			waitpid(pid, NULL, 0);
+	}
+	return -1;
+}
+
+void trie_finish() {
+	if (ts.finished)
+		return;
+	ts.finished = true;
+	ts.emulated->fetch_add(*ts.frame - ts.first_frame);
+	if (!ts.branched) {
+		// A leaf, its outputs are the outputs of every scenario it ran
+		for (auto s : ts.group) {
+			char dn[32];
+			sprintf(dn, "/scenario%03u", s);
+			std::string d = ts.outdir + dn;
+			mkdir(d.c_str(), 0755);
+			link_files(ts.dir, d, false);
+			for (const auto &f : ts.nolink)
+				link((ts.dir + "/" + f).c_str(), (d + "/" + f).c_str());
+		}
+	}
+	remove_dir(ts.dir);
+	if (!ts.root)
+		return;
+
+	// Trie size: number of distinct input prefixes at every frame, scenarios
+	// in the same class share their prefix so far.
+	unsigned frames = ts.buttons[0].size();
+	std::vector<unsigned> cls(ts.buttons.size(), 0);
+	uint64_t size = 0;
+	for (unsigned f = 0; f < frames; f++) {
+		std::map<std::pair<unsigned, uint32_t>, unsigned> next;
+		for (unsigned s = 0; s < cls.size(); s++)
+			cls[s] = next.emplace(std::make_pair(cls[s], ts.buttons[s][f]), next.size()).first->second;
+		size += next.size();
+	}
+	std::cout << "Scenario trie: " << ts.buttons.size() << " scenarios, " << ts.emulated->load()
+	          << " frames emulated (trie size " << size << ") instead of "
+	          << (uint64_t)frames * ts.buttons.size() << std::endl;
+}
@@ -0,0 +1,42 @@
+// Copyright 2021 David Guillen Fandos <david@davidgf.net>
+// Released under the GPL2 license
+
+#ifndef _TRIE_H__
+#define _TRIE_H__
+
+#include <stdint.h>
+#include <set>
+#include <string>
+#include <vector>
+
+// Input scenario trie: scenarios that share a prefix of their input are
+// emulated together, and the process forks (depth-first) at the frames where
+// they diverge, one child per group of scenarios with the same input. So the
+// number of emulated frames is the size of the trie rather than the sum of
+// all the scenario lengths.
+// Each process writes its outputs to its own (hidden) node directory, the
+// children start with hard links to the outputs of their parent. Files that
+// every process writes on its own ("nolink": the fingerprint and core logs)
+// are not linked, children copy or start them. The
+// processes that reach the end link their directory as "scenarioNNN".
+// Children run one at a time (depth-first), so --scenario-jobs does not apply.
+
+// Sets up the root process, "buttons" holds the per-frame input of every
+// scenario, "frame" points to the frame counter of the run. Returns the node
+// directory of the root.
+std::string trie_init(const std::vector<std::vector<uint32_t>> &buttons, const std::string &outdir,
+                      const std::set<std::string> &nolink, const unsigned *frame);
+
+// Whether the scenarios run by this process diverge at the given frame.
+bool trie_diverges(unsigned frame);
+
+// Works like fork(): returns the scenario whose input the child follows (the
+// group it runs share it), with "dir" set to its node directory. The parent
+// runs every child to completion (one at a time) and returns -1.
+int trie_branch(unsigned frame, std::string *dir);
+
+// To be called once the process is done with its outputs (it also runs at
+// exit, for processes that exit early).
+void trie_finish();
+
+#endif
@@ -3,58 +3,696 @@
 // Released under the GPL2 license
 
 #include <cstdlib>
+#include <cstring>
+#include <atomic>
+#include <errno.h>
+#include <limits.h>
 #include <unistd.h>
+#include <sys/uio.h>
 #include "util.h"
 
 #define STB_IMAGE_WRITE_IMPLEMENTATION
 #include "stb_image_write.h"
 
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+  #define CONV_X86
+  #include <immintrin.h>
+#elif defined(__ARM_NEON)
+  #define CONV_NEON
+  #include <arm_neon.h>
+#endif
+
 typedef struct {
 	uint8_t r, g, b;
 } pixel_t;
 
 typedef void* (*img_conv)(const void *data, unsigned width, unsigned height);
 
-void *image_convert(const void *data, unsigned width, unsigned height, size_t pitch, enum retro_pixel_format fmt) {
-	pixel_t *buffer = (pixel_t*)malloc(width * height * 3);
-	uint8_t *inbytes = (uint8_t*)data;
-	if (fmt == RETRO_PIXEL_FORMAT_XRGB8888) {
-		for (unsigned row = 0; row < height; row++) {
-			uint32_t *inbuf = (uint32_t*)&inbytes[row * pitch];
-			for (unsigned col = 0; col < width; col++) {
-				buffer[row * width + col].r = inbuf[col] >> 16;
-				buffer[row * width + col].g = inbuf[col] >>  8;
-				buffer[row * width + col].b = inbuf[col];
+// Converts a row of pixels (in some native format) into packed RGB24.
+typedef void (*row_conv_fn)(const uint8_t *in, uint8_t *out, unsigned width);
+
+// Scalar converters, used as fallback and to process the tail of each row.
+// The SIMD kernels below must produce the exact same output.
+
+static void conv_xrgb8888_scalar(const uint8_t *in, uint8_t *out, unsigned width) {
+	const uint32_t *inbuf = (const uint32_t*)in;
+	pixel_t *outbuf = (pixel_t*)out;
+	for (unsigned col = 0; col < width; col++) {
+		outbuf[col].r = inbuf[col] >> 16;
+		outbuf[col].g = inbuf[col] >>  8;
+		outbuf[col].b = inbuf[col];
+	}
+}
+
+static void conv_rgb565_scalar(const uint8_t *in, uint8_t *out, unsigned width) {
+	const uint16_t *inbuf = (const uint16_t*)in;
+	pixel_t *outbuf = (pixel_t*)out;
+	for (unsigned col = 0; col < width; col++) {
+		outbuf[col].r = ((inbuf[col] >> 11) & 0x1F) << 3;
+		outbuf[col].g = ((inbuf[col] >>  5) & 0x3F) << 2;
+		outbuf[col].b = ((inbuf[col] & 0x1F) << 3);
+	}
+}
+
+static void conv_0rgb1555_scalar(const uint8_t *in, uint8_t *out, unsigned width) {
+	const uint16_t *inbuf = (const uint16_t*)in;
+	pixel_t *outbuf = (pixel_t*)out;
+	for (unsigned col = 0; col < width; col++) {
+		outbuf[col].r = ((inbuf[col] >> 10) & 0x1F) << 3;
+		outbuf[col].g = ((inbuf[col] >>  5) & 0x1F) << 3;
+		outbuf[col].b = ((inbuf[col] & 0x1F) << 3);
+	}
+}
+
+// For the 16 bit formats the channels can be extracted with a shift and a mask:
+//   RGB565:   r = (p >> 8) & 0xF8,  g = (p >> 3) & 0xFC,  b = (p << 3) & 0xF8
+//   0RGB1555: r = (p >> 7) & 0xF8,  g = (p >> 2) & 0xF8,  b = (p << 3) & 0xF8
+
+#ifdef CONV_X86
+
+// Shuffle masks that interleave three planar R/G/B vectors (16 pixels) into
+// three vectors of packed RGB24 data (48 bytes). Indexed by [output][channel].
+alignas(16) static const int8_t rgb24_shuf[3][3][16] = {
+	{
+		{ 0, -1, -1,  1, -1, -1,  2, -1, -1,  3, -1, -1,  4, -1, -1,  5},
+		{-1,  0, -1, -1,  1, -1, -1,  2, -1, -1,  3, -1, -1,  4, -1, -1},
+		{-1, -1,  0, -1, -1,  1, -1, -1,  2, -1, -1,  3, -1, -1,  4, -1},
+	},
+	{
+		{-1, -1,  6, -1, -1,  7, -1, -1,  8, -1, -1,  9, -1, -1, 10, -1},
+		{ 5, -1, -1,  6, -1, -1,  7, -1, -1,  8, -1, -1,  9, -1, -1, 10},
+		{-1,  5, -1, -1,  6, -1, -1,  7, -1, -1,  8, -1, -1,  9, -1, -1},
+	},
+	{
+		{-1, 11, -1, -1, 12, -1, -1, 13, -1, -1, 14, -1, -1, 15, -1, -1},
+		{-1, -1, 11, -1, -1, 12, -1, -1, 13, -1, -1, 14, -1, -1, 15, -1},
+		{10, -1, -1, 11, -1, -1, 12, -1, -1, 13, -1, -1, 14, -1, -1, 15},
+	},
+};
+
+// Picks the R, G, B bytes of four XRGB8888 pixels into the lower 12 bytes.
+alignas(16) static const int8_t xrgb_shuf[16] = {
+	2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1
+};
+
+__attribute__((target("ssse3")))
+static inline void store_rgb24_ssse3(uint8_t *out, __m128i r, __m128i g, __m128i b) {
+	for (unsigned i = 0; i < 3; i++) {
+		__m128i v = _mm_or_si128(
+			_mm_or_si128(
+				_mm_shuffle_epi8(r, _mm_load_si128((const __m128i*)rgb24_shuf[i][0])),
+				_mm_shuffle_epi8(g, _mm_load_si128((const __m128i*)rgb24_shuf[i][1]))),
+			_mm_shuffle_epi8(b, _mm_load_si128((const __m128i*)rgb24_shuf[i][2])));
+		_mm_storeu_si128((__m128i*)&out[16 * i], v);
+	}
+}
+
+template <int rs, int gs, int gm>
+__attribute__((target("ssse3")))
+static void conv_16bit_ssse3(const uint8_t *in, uint8_t *out, unsigned width) {
+	const __m128i m8 = _mm_set1_epi16(0xF8), mg = _mm_set1_epi16(gm);
+	unsigned col = 0;
+	for (; col + 16 <= width; col += 16) {
+		__m128i p0 = _mm_loadu_si128((const __m128i*)&in[col * 2]);
+		__m128i p1 = _mm_loadu_si128((const __m128i*)&in[col * 2 + 16]);
+		__m128i r = _mm_packus_epi16(_mm_and_si128(_mm_srli_epi16(p0, rs), m8),
+		                             _mm_and_si128(_mm_srli_epi16(p1, rs), m8));
+		__m128i g = _mm_packus_epi16(_mm_and_si128(_mm_srli_epi16(p0, gs), mg),
+		                             _mm_and_si128(_mm_srli_epi16(p1, gs), mg));
+		__m128i b = _mm_packus_epi16(_mm_and_si128(_mm_slli_epi16(p0, 3), m8),
+		                             _mm_and_si128(_mm_slli_epi16(p1, 3), m8));
+		store_rgb24_ssse3(&out[col * 3], r, g, b);
+	}
+	if (gm == 0xFC)
+		conv_rgb565_scalar(&in[col * 2], &out[col * 3], width - col);
+	else
+		conv_0rgb1555_scalar(&in[col * 2], &out[col * 3], width - col);
+}
+
+__attribute__((target("ssse3")))
+static void conv_xrgb8888_ssse3(const uint8_t *in, uint8_t *out, unsigned width) {
+	const __m128i shuf = _mm_load_si128((const __m128i*)xrgb_shuf);
+	unsigned col = 0;
+	for (; col + 16 <= width; col += 16) {
+		// Each vector holds 12 valid bytes, stitch them into three full vectors.
+		__m128i a = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)&in[col * 4]), shuf);
+		__m128i b = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)&in[col * 4 + 16]), shuf);
+		__m128i c = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)&in[col * 4 + 32]), shuf);
+		__m128i d = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)&in[col * 4 + 48]), shuf);
+		_mm_storeu_si128((__m128i*)&out[col * 3],
+		                 _mm_or_si128(a, _mm_slli_si128(b, 12)));
+		_mm_storeu_si128((__m128i*)&out[col * 3 + 16],
+		                 _mm_or_si128(_mm_srli_si128(b, 4), _mm_slli_si128(c, 8)));
+		_mm_storeu_si128((__m128i*)&out[col * 3 + 32],
+		                 _mm_or_si128(_mm_srli_si128(c, 8), _mm_slli_si128(d, 4)));
+	}
+	conv_xrgb8888_scalar(&in[col * 4], &out[col * 3], width - col);
+}
+
+template <int rs, int gs, int gm>
+__attribute__((target("avx2")))
+static void conv_16bit_avx2(const uint8_t *in, uint8_t *out, unsigned width) {
+	const __m256i m8 = _mm256_set1_epi16(0xF8), mg = _mm256_set1_epi16(gm);
+	__m256i shuf[3][3];
+	for (unsigned i = 0; i < 3; i++)
+		for (unsigned j = 0; j < 3; j++)
+			shuf[i][j] = _mm256_broadcastsi128_si256(_mm_load_si128((const __m128i*)rgb24_shuf[i][j]));
+
+	unsigned col = 0;
+	for (; col + 32 <= width; col += 32) {
+		__m256i p0 = _mm256_loadu_si256((const __m256i*)&in[col * 2]);
+		__m256i p1 = _mm256_loadu_si256((const __m256i*)&in[col * 2 + 32]);
+		// Packing interleaves the 128 bit lanes, the permute restores pixel order
+		// so that lane 0 holds pixels 0-15 and lane 1 holds pixels 16-31.
+		__m256i r = _mm256_permute4x64_epi64(_mm256_packus_epi16(
+			_mm256_and_si256(_mm256_srli_epi16(p0, rs), m8),
+			_mm256_and_si256(_mm256_srli_epi16(p1, rs), m8)), 0xD8);
+		__m256i g = _mm256_permute4x64_epi64(_mm256_packus_epi16(
+			_mm256_and_si256(_mm256_srli_epi16(p0, gs), mg),
+			_mm256_and_si256(_mm256_srli_epi16(p1, gs), mg)), 0xD8);
+		__m256i b = _mm256_permute4x64_epi64(_mm256_packus_epi16(
+			_mm256_and_si256(_mm256_slli_epi16(p0, 3), m8),
+			_mm256_and_si256(_mm256_slli_epi16(p1, 3), m8)), 0xD8);
+
+		for (unsigned i = 0; i < 3; i++) {
+			__m256i v = _mm256_or_si256(
+				_mm256_or_si256(_mm256_shuffle_epi8(r, shuf[i][0]), _mm256_shuffle_epi8(g, shuf[i][1])),
+				_mm256_shuffle_epi8(b, shuf[i][2]));
+			_mm_storeu_si128((__m128i*)&out[col * 3 + 16 * i], _mm256_castsi256_si128(v));
+			_mm_storeu_si128((__m128i*)&out[col * 3 + 48 + 16 * i], _mm256_extracti128_si256(v, 1));
+		}
+	}
+	if (gm == 0xFC)
+		conv_rgb565_scalar(&in[col * 2], &out[col * 3], width - col);
+	else
+		conv_0rgb1555_scalar(&in[col * 2], &out[col * 3], width - col);
+}
+
+__attribute__((target("avx2")))
+static void conv_xrgb8888_avx2(const uint8_t *in, uint8_t *out, unsigned width) {
+	const __m256i shuf = _mm256_broadcastsi128_si256(_mm_load_si128((const __m128i*)xrgb_shuf));
+	// Moves the 12 valid bytes of each lane together (24 bytes in total)
+	const __m256i perm = _mm256_setr_epi32(0, 1, 2, 4, 5, 6, 3, 7);
+	unsigned col = 0;
+	for (; col + 8 <= width; col += 8) {
+		__m256i v = _mm256_shuffle_epi8(_mm256_loadu_si256((const __m256i*)&in[col * 4]), shuf);
+		v = _mm256_permutevar8x32_epi32(v, perm);
+		_mm_storeu_si128((__m128i*)&out[col * 3], _mm256_castsi256_si128(v));
+		_mm_storel_epi64((__m128i*)&out[col * 3 + 16], _mm256_extracti128_si256(v, 1));
+	}
+	conv_xrgb8888_scalar(&in[col * 4], &out[col * 3], width - col);
+}
+
+#endif
+
+#ifdef CONV_NEON
+
+template <int rs, int gs, int gm>
+static void conv_16bit_neon(const uint8_t *in, uint8_t *out, unsigned width) {
+	const uint16x8_t m8 = vdupq_n_u16(0xF8), mg = vdupq_n_u16(gm);
+	unsigned col = 0;
+	for (; col + 8 <= width; col += 8) {
+		uint16x8_t p = vld1q_u16((const uint16_t*)&in[col * 2]);
+		uint8x8x3_t rgb;
+		rgb.val[0] = vmovn_u16(vandq_u16(vshrq_n_u16(p, rs), m8));
+		rgb.val[1] = vmovn_u16(vandq_u16(vshrq_n_u16(p, gs), mg));
+		rgb.val[2] = vmovn_u16(vandq_u16(vshlq_n_u16(p, 3), m8));
+		vst3_u8(&out[col * 3], rgb);
+	}
+	if (gm == 0xFC)
+		conv_rgb565_scalar(&in[col * 2], &out[col * 3], width - col);
+	else
+		conv_0rgb1555_scalar(&in[col * 2], &out[col * 3], width - col);
+}
+
+static void conv_xrgb8888_neon(const uint8_t *in, uint8_t *out, unsigned width) {
+	unsigned col = 0;
+	for (; col + 8 <= width; col += 8) {
+		// Little endian XRGB8888 is laid out as B, G, R, X in memory
+		uint8x8x4_t p = vld4_u8(&in[col * 4]);
+		uint8x8x3_t rgb;
+		rgb.val[0] = p.val[2];
+		rgb.val[1] = p.val[1];
+		rgb.val[2] = p.val[0];
+		vst3_u8(&out[col * 3], rgb);
+	}
+	conv_xrgb8888_scalar(&in[col * 4], &out[col * 3], width - col);
+}
+
+#endif
+
+typedef struct {
+	row_conv_fn xrgb8888, rgb565, rgb1555;
+} converters_t;
+
+// Picks the best converters for the CPU we are running on (only once).
+static const converters_t *get_converters() {
+	static const converters_t convs = []() -> converters_t {
+		#ifdef CONV_X86
+		__builtin_cpu_init();
+		if (!getenv("MINIRETRO_NO_SIMD")) {
+			if (__builtin_cpu_supports("avx2"))
+				return { conv_xrgb8888_avx2, conv_16bit_avx2<8, 3, 0xFC>, conv_16bit_avx2<7, 2, 0xF8> };
+			if (__builtin_cpu_supports("ssse3"))
+				return { conv_xrgb8888_ssse3, conv_16bit_ssse3<8, 3, 0xFC>, conv_16bit_ssse3<7, 2, 0xF8> };
+		}
+		#elif defined(CONV_NEON)
+		if (!getenv("MINIRETRO_NO_SIMD"))
+			return { conv_xrgb8888_neon, conv_16bit_neon<8, 3, 0xFC>, conv_16bit_neon<7, 2, 0xF8> };
+		#endif
+		return { conv_xrgb8888_scalar, conv_rgb565_scalar, conv_0rgb1555_scalar };
+	}();
+	return &convs;
+}
+
+void image_convert(const void *data, unsigned width, unsigned height, size_t pitch, enum retro_pixel_format fmt, uint8_t *out) {
+	const uint8_t *inbytes = (const uint8_t*)data;
+	const converters_t *convs = get_converters();
+	row_conv_fn conv = fmt == RETRO_PIXEL_FORMAT_XRGB8888 ? convs->xrgb8888 :
+	                   fmt == RETRO_PIXEL_FORMAT_RGB565 ? convs->rgb565 : convs->rgb1555;
+
+	for (unsigned row = 0; row < height; row++)
+		conv(&inbytes[row * pitch], &out[row * width * 3], width);
+}
+
+static std::atomic<unsigned long> scratch_allocs(0);
+
+void *scratch_reserve(scratch_buffer_t *buf, size_t size) {
+	if (size > buf->size) {
+		// Grow geometrically (and keep the contents), since buffers can be appended to
+		size_t newsize = size > 2 * buf->size ? size : 2 * buf->size;
+		buf->data = realloc(buf->data, newsize);
+		buf->size = newsize;
+		scratch_allocs++;
+	}
+	return buf->data;
+}
+
+void scratch_free(scratch_buffer_t *buf) {
+	free(buf->data);
+	buf->data = NULL;
+	buf->size = 0;
+}
+
+unsigned long scratch_allocations() {
+	return scratch_allocs;
+}
+
+void dump_image(const void *data, unsigned width, unsigned height, size_t pitch, enum retro_pixel_format fmt, const char *filename, scratch_buffer_t *scratch) {
+	uint8_t *convimg = (uint8_t*)scratch_reserve(scratch, width * height * 3);
+	image_convert(data, width, height, pitch, fmt, convimg);
+	stbi_write_png(filename, width, height, 3, convimg, 3 * width);
+}
+
+// XXH64 (https://github.com/Cyan4973/xxHash) for short inputs, four
+// independent lanes keep the CPU pipelines busy.
+
+static const uint64_t XXH_P1 = 0x9E3779B185EBCA87ULL;
+static const uint64_t XXH_P2 = 0xC2B2AE3D27D4EB4FULL;
+static const uint64_t XXH_P3 = 0x165667B19E3779F9ULL;
+static const uint64_t XXH_P4 = 0x85EBCA77C2B2AE63ULL;
+static const uint64_t XXH_P5 = 0x27D4EB2F165667C5ULL;
+
+static inline uint64_t rotl64(uint64_t x, unsigned r) {
+	return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t read64(const uint8_t *p) {
+	uint64_t v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static inline uint32_t read32(const uint8_t *p) {
+	uint32_t v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static inline uint64_t xxh_round(uint64_t acc, uint64_t input) {
+	return rotl64(acc + input * XXH_P2, 31) * XXH_P1;
+}
+
+static inline uint64_t xxh_merge(uint64_t acc, uint64_t val) {
+	return (acc ^ xxh_round(0, val)) * XXH_P1 + XXH_P4;
+}
+
+// Bulk inputs (frames, RAM) go through an XXH3 style accumulator instead: 8
+// lanes take a 64 byte stripe at a time with 32x32 bit multiplies, which map
+// to plain SIMD (no 64 bit multiplies), and get scrambled every 8 stripes.
+// Every implementation must produce the same result as the scalar one.
+
+#define HASH_STRIPE     64
+#define HASH_BLOCK      (8 * HASH_STRIPE)
+#define HASH_BULK_MIN   1024
+#define HASH_PRIME32    0x9E3779B1U
+
+// Stripe n of a block uses keys n..n+7, the scramble uses keys 8..15
+alignas(32) static const uint64_t hash_secret[16] = {
+	0xE220A8397B1DCDAFULL, 0x6E789E6AA1B965F4ULL, 0x06C45D188009454FULL, 0xF88BB8A8724C81ECULL,
+	0x1B39896A51A8749BULL, 0x53CB9F0C747EA2EAULL, 0x2C829ABE1F4532E1ULL, 0xC584133AC916AB3CULL,
+	0x3EE5789041C98AC3ULL, 0xF3B8488C368CB0A6ULL, 0x657EECDD3CB13D09ULL, 0xC2D326E0055BDEF6ULL,
+	0x8621A03FE0BBDB7BULL, 0x8E1F7555983AA92FULL, 0xB54E0F1600CC4D19ULL, 0x84BB3F97971D80ABULL,
+};
+
+// Accumulates whole blocks (8 stripes and a scramble each)
+typedef void (*hash_blocks_fn)(uint64_t *acc, const uint8_t *p, size_t nblocks);
+
+static inline void hash_stripe_scalar(uint64_t *acc, const uint8_t *p, const uint64_t *key) {
+	for (unsigned i = 0; i < 8; i++) {
+		uint64_t d = read64(p + 8 * i), k = d ^ key[i];
+		acc[i ^ 1] += d;
+		acc[i] += (k & 0xFFFFFFFF) * (k >> 32);
+	}
+}
+
+static void hash_blocks_scalar(uint64_t *acc, const uint8_t *p, size_t nblocks) {
+	for (; nblocks; nblocks--) {
+		for (unsigned n = 0; n < 8; n++, p += HASH_STRIPE)
+			hash_stripe_scalar(acc, p, &hash_secret[n]);
+		for (unsigned i = 0; i < 8; i++)
+			acc[i] = ((acc[i] ^ (acc[i] >> 47)) ^ hash_secret[8 + i]) * HASH_PRIME32;
+	}
+}
+
+#ifdef CONV_X86
+
+__attribute__((target("sse2")))
+static void hash_blocks_sse2(uint64_t *acc, const uint8_t *p, size_t nblocks) {
+	const __m128i prime = _mm_set1_epi32(HASH_PRIME32);
+	__m128i a[4];
+	for (unsigned i = 0; i < 4; i++)
+		a[i] = _mm_loadu_si128((const __m128i*)&acc[2 * i]);
+	for (; nblocks; nblocks--) {
+		for (unsigned n = 0; n < 8; n++, p += HASH_STRIPE) {
+			for (unsigned i = 0; i < 4; i++) {
+				__m128i d = _mm_loadu_si128((const __m128i*)&p[16 * i]);
+				__m128i k = _mm_xor_si128(d, _mm_loadu_si128((const __m128i*)&hash_secret[n + 2 * i]));
+				__m128i m = _mm_mul_epu32(k, _mm_shuffle_epi32(k, _MM_SHUFFLE(0, 3, 0, 1)));
+				a[i] = _mm_add_epi64(a[i], _mm_add_epi64(m, _mm_shuffle_epi32(d, _MM_SHUFFLE(1, 0, 3, 2))));
 			}
 		}
+		for (unsigned i = 0; i < 4; i++) {
+			__m128i v = _mm_xor_si128(a[i], _mm_srli_epi64(a[i], 47));
+			v = _mm_xor_si128(v, _mm_load_si128((const __m128i*)&hash_secret[8 + 2 * i]));
+			__m128i hi = _mm_mul_epu32(_mm_srli_epi64(v, 32), prime);
+			a[i] = _mm_add_epi64(_mm_mul_epu32(v, prime), _mm_slli_epi64(hi, 32));
+		}
 	}
-	else if (fmt == RETRO_PIXEL_FORMAT_RGB565) {
-		for (unsigned row = 0; row < height; row++) {
-			uint16_t *inbuf = (uint16_t*)&inbytes[row * pitch];
-			for (unsigned col = 0; col < width; col++) {
-				buffer[row * width + col].r = ((inbuf[col] >> 11) & 0x1F) << 3;
-				buffer[row * width + col].g = ((inbuf[col] >>  5) & 0x3F) << 2;
-				buffer[row * width + col].b = ((inbuf[col] & 0x1F) << 3);
+	for (unsigned i = 0; i < 4; i++)
+		_mm_storeu_si128((__m128i*)&acc[2 * i], a[i]);
+}
+
+__attribute__((target("avx2")))
+static void hash_blocks_avx2(uint64_t *acc, const uint8_t *p, size_t nblocks) {
+	const __m256i prime = _mm256_set1_epi32(HASH_PRIME32);
+	__m256i a[2];
+	for (unsigned i = 0; i < 2; i++)
+		a[i] = _mm256_loadu_si256((const __m256i*)&acc[4 * i]);
+	for (; nblocks; nblocks--) {
+		for (unsigned n = 0; n < 8; n++, p += HASH_STRIPE) {
+			for (unsigned i = 0; i < 2; i++) {
+				__m256i d = _mm256_loadu_si256((const __m256i*)&p[32 * i]);
+				__m256i k = _mm256_xor_si256(d, _mm256_loadu_si256((const __m256i*)&hash_secret[n + 4 * i]));
+				__m256i m = _mm256_mul_epu32(k, _mm256_shuffle_epi32(k, _MM_SHUFFLE(0, 3, 0, 1)));
+				a[i] = _mm256_add_epi64(a[i], _mm256_add_epi64(m, _mm256_shuffle_epi32(d, _MM_SHUFFLE(1, 0, 3, 2))));
 			}
 		}
+		for (unsigned i = 0; i < 2; i++) {
+			__m256i v = _mm256_xor_si256(a[i], _mm256_srli_epi64(a[i], 47));
+			v = _mm256_xor_si256(v, _mm256_load_si256((const __m256i*)&hash_secret[8 + 4 * i]));
+			__m256i hi = _mm256_mul_epu32(_mm256_srli_epi64(v, 32), prime);
+			a[i] = _mm256_add_epi64(_mm256_mul_epu32(v, prime), _mm256_slli_epi64(hi, 32));
+		}
 	}
-	else {
-		for (unsigned row = 0; row < height; row++) {
-			uint16_t *inbuf = (uint16_t*)&inbytes[row * pitch];
-			for (unsigned col = 0; col < width; col++) {
-				buffer[row * width + col].r = ((inbuf[col] >> 10) & 0x1F) << 3;
-				buffer[row * width + col].g = ((inbuf[col] >>  5) & 0x1F) << 3;
-				buffer[row * width + col].b = ((inbuf[col] & 0x1F) << 3);
+	for (unsigned i = 0; i < 2; i++)
+		_mm256_storeu_si256((__m256i*)&acc[4 * i], a[i]);
+}
+
+#endif
+
+#ifdef CONV_NEON
+
+static void hash_blocks_neon(uint64_t *acc, const uint8_t *p, size_t nblocks) {
+	const uint32x2_t prime = vdup_n_u32(HASH_PRIME32);
+	uint64x2_t a[4];
+	for (unsigned i = 0; i < 4; i++)
+		a[i] = vld1q_u64(&acc[2 * i]);
+	for (; nblocks; nblocks--) {
+		for (unsigned n = 0; n < 8; n++, p += HASH_STRIPE) {
+			for (unsigned i = 0; i < 4; i++) {
+				uint64x2_t d = vreinterpretq_u64_u8(vld1q_u8(&p[16 * i]));
+				uint64x2_t k = veorq_u64(d, vld1q_u64(&hash_secret[n + 2 * i]));
+				a[i] = vaddq_u64(a[i], vextq_u64(d, d, 1));
+				a[i] = vmlal_u32(a[i], vmovn_u64(k), vshrn_n_u64(k, 32));
 			}
 		}
+		for (unsigned i = 0; i < 4; i++) {
+			uint64x2_t v = veorq_u64(a[i], vshrq_n_u64(a[i], 47));
+			v = veorq_u64(v, vld1q_u64(&hash_secret[8 + 2 * i]));
+			uint64x2_t hi = vshlq_n_u64(vmull_u32(vshrn_n_u64(v, 32), prime), 32);
+			a[i] = vmlal_u32(hi, vmovn_u64(v), prime);
+		}
 	}
-	return buffer;
+	for (unsigned i = 0; i < 4; i++)
+		vst1q_u64(&acc[2 * i], a[i]);
 }
 
-void dump_image(const void *data, unsigned width, unsigned height, size_t pitch, enum retro_pixel_format fmt, const char *filename) {
-	void *convimg = image_convert(data, width, height, pitch, fmt);
-	stbi_write_png(filename, width, height, 3, convimg, 3 * width);
-	free(convimg);
+#endif
+
+// Picks the best block hasher for the CPU we are running on (only once).
+static hash_blocks_fn get_hasher() {
+	static const hash_blocks_fn fn = []() -> hash_blocks_fn {
+		#ifdef CONV_X86
+		__builtin_cpu_init();
+		if (!getenv("MINIRETRO_NO_SIMD")) {
+			if (__builtin_cpu_supports("avx2"))
+				return hash_blocks_avx2;
+			if (__builtin_cpu_supports("sse2"))
+				return hash_blocks_sse2;
+		}
+		#elif defined(CONV_NEON)
+		if (!getenv("MINIRETRO_NO_SIMD"))
+			return hash_blocks_neon;
+		#endif
+		return hash_blocks_scalar;
+	}();
+	return fn;
+}
+
+// Mixes in the last bytes (less than a lane/stripe) and avalanches
+static uint64_t hash64_finish(uint64_t h, const uint8_t *p, const uint8_t *end) {
+	for (; p + 8 <= end; p += 8)
+		h = rotl64(h ^ xxh_round(0, read64(p)), 27) * XXH_P1 + XXH_P4;
+	if (p + 4 <= end) {
+		h = rotl64(h ^ (read32(p) * XXH_P1), 23) * XXH_P2 + XXH_P3;
+		p += 4;
+	}
+	for (; p < end; p++)
+		h = rotl64(h ^ (*p * XXH_P5), 11) * XXH_P1;
+
+	h ^= h >> 33;
+	h *= XXH_P2;
+	h ^= h >> 29;
+	h *= XXH_P3;
+	h ^= h >> 32;
+	return h;
+}
+
+static uint64_t hash64_bulk(const uint8_t *p, size_t len, uint64_t seed) {
+	const uint8_t *end = p + len;
+	uint64_t acc[8] = {
+		HASH_PRIME32 + seed, XXH_P1 + seed, XXH_P2 + seed, XXH_P3 + seed,
+		XXH_P4 + seed, XXH_P5 + seed, XXH_P1 - seed, XXH_P2 - seed };
+	size_t nblocks = len / HASH_BLOCK;
+	get_hasher()(acc, p, nblocks);
+	p += nblocks * HASH_BLOCK;
+	for (unsigned n = 0; p + HASH_STRIPE <= end; n++, p += HASH_STRIPE)
+		hash_stripe_scalar(acc, p, &hash_secret[n]);
+
+	uint64_t h = seed + len * XXH_P1;
+	for (unsigned i = 0; i < 8; i++)
+		h = xxh_merge(h, acc[i]);
+	return hash64_finish(h, p, end);
+}
+
+uint64_t hash64(const void *data, size_t len, uint64_t seed) {
+	const uint8_t *p = (const uint8_t*)data;
+	const uint8_t *end = p + len;
+	uint64_t h;
+
+	if (len >= HASH_BULK_MIN)
+		return hash64_bulk(p, len, seed);
+
+	if (len >= 32) {
+		uint64_t v1 = seed + XXH_P1 + XXH_P2, v2 = seed + XXH_P2;
+		uint64_t v3 = seed, v4 = seed - XXH_P1;
+		for (; p + 32 <= end; p += 32) {
+			v1 = xxh_round(v1, read64(p));
+			v2 = xxh_round(v2, read64(p + 8));
+			v3 = xxh_round(v3, read64(p + 16));
+			v4 = xxh_round(v4, read64(p + 24));
+		}
+		h = rotl64(v1, 1) + rotl64(v2, 7) + rotl64(v3, 12) + rotl64(v4, 18);
+		h = xxh_merge(h, v1);
+		h = xxh_merge(h, v2);
+		h = xxh_merge(h, v3);
+		h = xxh_merge(h, v4);
+	}
+	else
+		h = seed + XXH_P5;
+
+	return hash64_finish(h + len, p, end);
+}
+
+uint64_t hash_image(const void *data, unsigned width, unsigned height, size_t pitch, enum retro_pixel_format fmt, scratch_buffer_t *scratch) {
+	// Normalize to RGB24 so that padding, pitch and the X byte do not matter.
+	uint8_t *rgb = (uint8_t*)scratch_reserve(scratch, width * height * 3);
+	image_convert(data, width, height, pitch, fmt, rgb);
+	return hash64(rgb, width * height * 3, ((uint64_t)width << 32) | height);
+}
+
+// Plain SHA-1 (FIPS 180-1), only used to name things, never on hot paths.
+
+static inline uint32_t rotl32(uint32_t x, unsigned r) {
+	return (x << r) | (x >> (32 - r));
+}
+
+static void sha1_block(uint32_t h[5], const uint8_t *blk) {
+	uint32_t w[80];
+	for (unsigned i = 0; i < 16; i++)
+		w[i] = (blk[i*4] << 24) | (blk[i*4+1] << 16) | (blk[i*4+2] << 8) | blk[i*4+3];
+	for (unsigned i = 16; i < 80; i++)
+		w[i] = rotl32(w[i-3] ^ w[i-8] ^ w[i-14] ^ w[i-16], 1);
+
+	uint32_t a = h[0], b = h[1], c = h[2], d = h[3], e = h[4];
+	for (unsigned i = 0; i < 80; i++) {
+		uint32_t f, k;
+		if (i < 20)
+			f = (b & c) | (~b & d), k = 0x5A827999;
+		else if (i < 40)
+			f = b ^ c ^ d, k = 0x6ED9EBA1;
+		else if (i < 60)
+			f = (b & c) | (b & d) | (c & d), k = 0x8F1BBCDC;
+		else
+			f = b ^ c ^ d, k = 0xCA62C1D6;
+		uint32_t t = rotl32(a, 5) + f + e + k + w[i];
+		e = d;
+		d = c;
+		c = rotl32(b, 30);
+		b = a;
+		a = t;
+	}
+	h[0] += a;
+	h[1] += b;
+	h[2] += c;
+	h[3] += d;
+	h[4] += e;
+}
+
+void sha1(const void *data, size_t len, uint8_t digest[20]) {
+	uint32_t h[5] = {0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0};
+	const uint8_t *p = (const uint8_t*)data;
+	size_t left = len;
+	for (; left >= 64; p += 64, left -= 64)
+		sha1_block(h, p);
+
+	// Padding: 0x80, zeros and the bit length (big endian)
+	uint8_t tail[128] = {0};
+	memcpy(tail, p, left);
+	tail[left] = 0x80;
+	unsigned tlen = left < 56 ? 64 : 128;
+	uint64_t bits = (uint64_t)len * 8;
+	for (unsigned i = 0; i < 8; i++)
+		tail[tlen - 1 - i] = bits >> (i * 8);
+	for (unsigned i = 0; i < tlen; i += 64)
+		sha1_block(h, &tail[i]);
+
+	for (unsigned i = 0; i < 20; i++)
+		digest[i] = h[i / 4] >> (24 - (i % 4) * 8);
+}
+
+uint8_t *encode_png(const uint8_t *rgb, unsigned width, unsigned height, int *len) {
+	return stbi_write_png_to_mem(rgb, 3 * width, width, height, 3, len);
+}
+
+bool write_all(int fd, const void *data, size_t size) {
+	const uint8_t *ptr = (const uint8_t*)data;
+	while (size) {
+		ssize_t w = write(fd, ptr, size);
+		if (w < 0) {
+			if (errno == EINTR)
+				continue;
+			return false;
+		}
+		ptr += w;
+		size -= w;
+	}
+	return true;
+}
+
+// Like writev() but retries until all the buffers are written (modifies iov).
+static bool writev_all(int fd, struct iovec *iov, unsigned cnt) {
+	while (cnt) {
+		ssize_t w = writev(fd, iov, cnt > IOV_MAX ? IOV_MAX : cnt);
+		if (w < 0) {
+			if (errno == EINTR)
+				continue;
+			return false;
+		}
+		while (cnt && (size_t)w >= iov->iov_len) {
+			w -= iov->iov_len;
+			iov++;
+			cnt--;
+		}
+		if (cnt) {
+			iov->iov_base = (uint8_t*)iov->iov_base + w;
+			iov->iov_len -= w;
+		}
+	}
+	return true;
+}
+
+const char *ffmpeg_pixfmt(enum retro_pixel_format fmt) {
+	switch (fmt) {
+	case RETRO_PIXEL_FORMAT_XRGB8888:
+		return "bgr0";
+	case RETRO_PIXEL_FORMAT_RGB565:
+		return "rgb565le";
+	default:
+		return "rgb555le";
+	};
+}
+
+void dump_raw_frame(const void *data, unsigned width, unsigned height, size_t pitch, enum retro_pixel_format fmt,
+                    unsigned outw, unsigned outh, int fd, scratch_buffer_t *scratch) {
+	const uint8_t *inbytes = (const uint8_t*)data;
+	unsigned bpp = fmt == RETRO_PIXEL_FORMAT_XRGB8888 ? 4 : 2;
+	if (width == outw && height == outh && pitch == width * bpp) {
+		write_all(fd, data, outh * pitch);
+		return;
+	}
+
+	// Write rows directly from the core buffer, cropping or padding (with black)
+	// to match the fixed output size that ffmpeg expects.
+	unsigned copyw = (width < outw ? width : outw) * bpp;
+	size_t padsize = (size_t)outw * bpp;
+	size_t iovsize = sizeof(struct iovec) * outh * 2;
+	struct iovec *iov = (struct iovec*)scratch_reserve(scratch, iovsize + padsize);
+	uint8_t *zeros = (uint8_t*)iov + iovsize;
+	memset(zeros, 0, padsize);
+
+	unsigned cnt = 0;
+	for (unsigned row = 0; row < outh; row++) {
+		if (row < height) {
+			iov[cnt++] = { (void*)&inbytes[row * pitch], copyw };
+			if (copyw < padsize)
+				iov[cnt++] = { zeros, padsize - copyw };
+		}
+		else
+			iov[cnt++] = { zeros, padsize };
+	}
+	writev_all(fd, iov, cnt);
 }
 
 static void cb_write(void *context, void *data, int size) {
@@ -62,9 +700,9 @@ static void cb_write(void *context, void *data, int size) {
 	write(fd, data, size);
 }
 
-void dump_image(const void *data, unsigned width, unsigned height, size_t pitch, enum retro_pixel_format fmt, int fd) {
-	void *convimg = image_convert(data, width, height, pitch, fmt);
+void dump_image(const void *data, unsigned width, unsigned height, size_t pitch, enum retro_pixel_format fmt, int fd, scratch_buffer_t *scratch) {
+	uint8_t *convimg = (uint8_t*)scratch_reserve(scratch, width * height * 3);
+	image_convert(data, width, height, pitch, fmt, convimg);
 	stbi_write_bmp_to_func(cb_write, &fd, width, height, 3, convimg);
-	free(convimg);
 }
 
@@ -3,10 +3,49 @@
 #define _UTIL_H__
 
 #include <stdint.h>
+#include <stddef.h>
 #include "libretro.h"
 
-void dump_image(const void *data, unsigned width, unsigned height, size_t pitch, enum retro_pixel_format fmt, const char *filename);
-void dump_image(const void *data, unsigned width, unsigned height, size_t pitch, enum retro_pixel_format fmt, int fd);
+// Grow-only buffer that is reused across frames, so that the steady state
+// frame loop does not need to allocate any memory.
+typedef struct {
+	void *data;
+	size_t size;
+} scratch_buffer_t;
 
-#endif
+// Returns a buffer of at least "size" bytes, only reallocates if it needs to grow
+// (preserving its contents).
+void *scratch_reserve(scratch_buffer_t *buf, size_t size);
+void scratch_free(scratch_buffer_t *buf);
+// Number of allocations performed by all scratch buffers so far.
+unsigned long scratch_allocations();
+
+// Converts an image (in any retro pixel format) to packed RGB24 into "out".
+void image_convert(const void *data, unsigned width, unsigned height, size_t pitch, enum retro_pixel_format fmt, uint8_t *out);
+
+// Fast non-cryptographic 64 bit hash (XXH64, with an XXH3 style SIMD path for
+// inputs of 1KB and up). Same results on every CPU (and MINIRETRO_NO_SIMD).
+uint64_t hash64(const void *data, size_t len, uint64_t seed);
+// Hashes the visible pixels of an image (pitch and pixel format independent).
+uint64_t hash_image(const void *data, unsigned width, unsigned height, size_t pitch, enum retro_pixel_format fmt, scratch_buffer_t *scratch);
+
+// SHA-1 digest, miniretro uses it to name ROMs (just like regression.py does).
+void sha1(const void *data, size_t len, uint8_t digest[20]);
+
+// Encodes an RGB24 image as PNG, returns a malloc'ed buffer (of "len" bytes).
+uint8_t *encode_png(const uint8_t *rgb, unsigned width, unsigned height, int *len);
 
+void dump_image(const void *data, unsigned width, unsigned height, size_t pitch, enum retro_pixel_format fmt, const char *filename, scratch_buffer_t *scratch);
+void dump_image(const void *data, unsigned width, unsigned height, size_t pitch, enum retro_pixel_format fmt, int fd, scratch_buffer_t *scratch);
+
+// Writes the whole buffer, retrying on partial writes and interruptions.
+bool write_all(int fd, const void *data, size_t size);
+
+// Returns the ffmpeg pixel format name for a given retro pixel format.
+const char *ffmpeg_pixfmt(enum retro_pixel_format fmt);
+
+// Writes the frame in its native pixel format (cropped or padded to outw x outh).
+void dump_raw_frame(const void *data, unsigned width, unsigned height, size_t pitch, enum retro_pixel_format fmt,
+                    unsigned outw, unsigned outh, int fd, scratch_buffer_t *scratch);
+
+#endif
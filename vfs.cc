@@ -0,0 +1,380 @@
+// Copyright 2021 David Guillen Fandos <david@davidgf.net>
+// Released under the GPL2 license
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <algorithm>
+#include <mutex>
+#include <atomic>
+#include <map>
+#include "vfs.h"
+
+#define VFS_VERSION       3
+#define VFS_SMALL_READ   64     // Reads below this size are flagged as small
+
+typedef struct {
+	std::atomic<uint64_t> opens, reads, rdbytes, smallreads, seeks, writes, wrbytes;
+	bool cached;
+} vfs_stats_t;
+
+// Cached mapping of a system dir file, revalidated against the file on open.
+typedef struct {
+	const uint8_t *map;
+	size_t size;
+	dev_t dev;
+	ino_t ino;
+	struct timespec mtime;
+	unsigned refs;
+} vfs_cache_t;
+
+struct retro_vfs_file_handle {
+	std::string path;
+	int fd;                  // Only for writable files
+	const uint8_t *map;      // Read-only view (NULL for empty or writable files)
+	size_t size;
+	int64_t pos;
+	vfs_cache_t *cache;      // Owner of the mapping if cached
+	vfs_stats_t *stats;
+};
+
+struct retro_vfs_dir_handle {
+	std::string path;
+	DIR *dir;
+	struct dirent *ent;
+	bool hidden;
+};
+
+static std::mutex vfs_mutex;
+static std::string vfs_sysdir;
+static std::map<std::string, vfs_stats_t> vfs_stats;
+static std::map<std::string, vfs_cache_t> vfs_cache;
+
+static std::string abspath(const char *path) {
+	char *rp = realpath(path, NULL);
+	if (!rp)
+		return path;
+	std::string ret(rp);
+	free(rp);
+	return ret;
+}
+
+void vfs_init(const std::string &sysdir) {
+	vfs_sysdir = sysdir.empty() ? "" : abspath(sysdir.c_str()) + "/";
+}
+
+void vfs_deinit() {
+	std::lock_guard<std::mutex> g(vfs_mutex);
+	for (auto &it : vfs_cache)
+		if (it.second.map)
+			munmap((void*)it.second.map, it.second.size);
+	vfs_cache.clear();
+}
+
+static const char* RETRO_CALLCONV vfs_get_path(struct retro_vfs_file_handle *f) {
+	return f->path.c_str();
+}
+
+// Maps a file read-only, going through the cache for system dir files.
+static bool vfs_map(struct retro_vfs_file_handle *f, const std::string &apath) {
+	int fd = open(f->path.c_str(), O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return false;
+	struct stat st;
+	if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode)) {
+		close(fd);
+		return false;
+	}
+
+	bool cacheable = !vfs_sysdir.empty() && !apath.compare(0, vfs_sysdir.size(), vfs_sysdir);
+	if (cacheable) {
+		std::lock_guard<std::mutex> g(vfs_mutex);
+		auto it = vfs_cache.find(apath);
+		if (it != vfs_cache.end()) {
+			vfs_cache_t *c = &it->second;
+			if (c->dev == st.st_dev && c->ino == st.st_ino && c->size == (size_t)st.st_size &&
+			    c->mtime.tv_sec == st.st_mtim.tv_sec && c->mtime.tv_nsec == st.st_mtim.tv_nsec) {
+				close(fd);
+				c->refs++;
+				f->map = c->map;
+				f->size = c->size;
+				f->cache = c;
+				return true;
+			}
+			// The file changed, drop the stale mapping if nobody is using it.
+			if (!c->refs) {
+				if (c->map)
+					munmap((void*)c->map, c->size);
+				vfs_cache.erase(it);
+			}
+			else
+				cacheable = false;
+		}
+	}
+
+	const uint8_t *map = NULL;
+	if (st.st_size) {
+		void *m = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (m == MAP_FAILED) {
+			close(fd);
+			return false;
+		}
+		map = (const uint8_t*)m;
+	}
+	close(fd);
+
+	f->map = map;
+	f->size = st.st_size;
+	if (cacheable) {
+		std::lock_guard<std::mutex> g(vfs_mutex);
+		if (!vfs_cache.count(apath)) {
+			vfs_cache_t *c = &vfs_cache[apath];
+			c->map = map;
+			c->size = st.st_size;
+			c->dev = st.st_dev;
+			c->ino = st.st_ino;
+			c->mtime = st.st_mtim;
+			c->refs = 1;
+			f->cache = c;
+			if (map)
+				madvise((void*)map, st.st_size, MADV_WILLNEED);
+		}
+	}
+	return true;
+}
+
+static struct retro_vfs_file_handle* RETRO_CALLCONV vfs_open(const char *path, unsigned mode, unsigned hints) {
+	if (!path || !(mode & RETRO_VFS_FILE_ACCESS_READ_WRITE))
+		return NULL;
+
+	struct retro_vfs_file_handle *f = new struct retro_vfs_file_handle();
+	f->path = path;
+	f->fd = -1;
+	f->map = NULL;
+	f->size = 0;
+	f->pos = 0;
+	f->cache = NULL;
+
+	std::string apath = abspath(path);
+	if (mode == RETRO_VFS_FILE_ACCESS_READ) {
+		if (!vfs_map(f, apath)) {
+			delete f;
+			return NULL;
+		}
+		if (f->map && !f->cache && (hints & RETRO_VFS_FILE_ACCESS_HINT_FREQUENT_ACCESS))
+			madvise((void*)f->map, f->size, MADV_WILLNEED);
+	}
+	else {
+		int flags = O_CREAT | O_CLOEXEC;
+		flags |= (mode & RETRO_VFS_FILE_ACCESS_READ) ? O_RDWR : O_WRONLY;
+		if (!(mode & RETRO_VFS_FILE_ACCESS_UPDATE_EXISTING))
+			flags |= O_TRUNC;
+		f->fd = open(path, flags, 0644);
+		if (f->fd < 0) {
+			delete f;
+			return NULL;
+		}
+		apath = abspath(path);   // Might have been just created
+	}
+
+	std::lock_guard<std::mutex> g(vfs_mutex);
+	f->stats = &vfs_stats[apath];
+	f->stats->opens++;
+	f->stats->cached |= (f->cache != NULL);
+	return f;
+}
+
+static int RETRO_CALLCONV vfs_close(struct retro_vfs_file_handle *f) {
+	if (f->cache) {
+		std::lock_guard<std::mutex> g(vfs_mutex);
+		f->cache->refs--;
+	}
+	else if (f->map)
+		munmap((void*)f->map, f->size);
+	int ret = 0;
+	if (f->fd >= 0)
+		ret = close(f->fd);
+	delete f;
+	return ret < 0 ? -1 : 0;
+}
+
+static int64_t RETRO_CALLCONV vfs_size(struct retro_vfs_file_handle *f) {
+	if (f->fd >= 0) {
+		struct stat st;
+		if (fstat(f->fd, &st) < 0)
+			return -1;
+		return st.st_size;
+	}
+	return f->size;
+}
+
+static int64_t RETRO_CALLCONV vfs_truncate(struct retro_vfs_file_handle *f, int64_t length) {
+	if (f->fd < 0 || ftruncate(f->fd, length) < 0)
+		return -1;
+	return 0;
+}
+
+static int64_t RETRO_CALLCONV vfs_tell(struct retro_vfs_file_handle *f) {
+	return f->pos;
+}
+
+static int64_t RETRO_CALLCONV vfs_seek(struct retro_vfs_file_handle *f, int64_t offset, int whence) {
+	int64_t npos;
+	switch (whence) {
+	case RETRO_VFS_SEEK_POSITION_START:
+		npos = offset;
+		break;
+	case RETRO_VFS_SEEK_POSITION_CURRENT:
+		npos = f->pos + offset;
+		break;
+	case RETRO_VFS_SEEK_POSITION_END:
+		npos = vfs_size(f) + offset;
+		break;
+	default:
+		return -1;
+	};
+	if (npos < 0)
+		return -1;
+	f->stats->seeks++;
+	f->pos = npos;
+	return 0;
+}
+
+static int64_t RETRO_CALLCONV vfs_read(struct retro_vfs_file_handle *f, void *s, uint64_t len) {
+	int64_t rd;
+	if (f->fd >= 0) {
+		rd = pread(f->fd, s, len, f->pos);
+		if (rd < 0)
+			return -1;
+	}
+	else {
+		rd = (uint64_t)f->pos < f->size ? std::min(len, (uint64_t)(f->size - f->pos)) : 0;
+		if (rd)
+			memcpy(s, &f->map[f->pos], rd);
+	}
+	f->pos += rd;
+	f->stats->reads++;
+	f->stats->rdbytes += rd;
+	if (len < VFS_SMALL_READ)
+		f->stats->smallreads++;
+	return rd;
+}
+
+static int64_t RETRO_CALLCONV vfs_write(struct retro_vfs_file_handle *f, const void *s, uint64_t len) {
+	if (f->fd < 0)
+		return -1;
+	int64_t wr = pwrite(f->fd, s, len, f->pos);
+	if (wr < 0)
+		return -1;
+	f->pos += wr;
+	f->stats->writes++;
+	f->stats->wrbytes += wr;
+	return wr;
+}
+
+static int RETRO_CALLCONV vfs_flush(struct retro_vfs_file_handle *f) {
+	return 0;
+}
+
+static int RETRO_CALLCONV vfs_remove(const char *path) {
+	return unlink(path) < 0 ? -1 : 0;
+}
+
+static int RETRO_CALLCONV vfs_rename(const char *oldp, const char *newp) {
+	return rename(oldp, newp) < 0 ? -1 : 0;
+}
+
+static int RETRO_CALLCONV vfs_stat(const char *path, int32_t *size) {
+	struct stat st;
+	if (stat(path, &st) < 0)
+		return 0;
+	if (size)
+		*size = (int32_t)st.st_size;
+	return RETRO_VFS_STAT_IS_VALID |
+	       (S_ISDIR(st.st_mode) ? RETRO_VFS_STAT_IS_DIRECTORY : 0) |
+	       (S_ISCHR(st.st_mode) ? RETRO_VFS_STAT_IS_CHARACTER_SPECIAL : 0);
+}
+
+static int RETRO_CALLCONV vfs_mkdir(const char *dir) {
+	if (mkdir(dir, 0755) < 0)
+		return errno == EEXIST ? -2 : -1;
+	return 0;
+}
+
+static struct retro_vfs_dir_handle* RETRO_CALLCONV vfs_opendir(const char *dir, bool include_hidden) {
+	DIR *d = opendir(dir);
+	if (!d)
+		return NULL;
+	struct retro_vfs_dir_handle *h = new struct retro_vfs_dir_handle();
+	h->path = dir;
+	h->dir = d;
+	h->ent = NULL;
+	h->hidden = include_hidden;
+	return h;
+}
+
+static bool RETRO_CALLCONV vfs_readdir(struct retro_vfs_dir_handle *h) {
+	while ((h->ent = readdir(h->dir))) {
+		const char *n = h->ent->d_name;
+		if (!strcmp(n, ".") || !strcmp(n, ".."))
+			continue;
+		if (n[0] == '.' && !h->hidden)
+			continue;
+		return true;
+	}
+	return false;
+}
+
+static const char* RETRO_CALLCONV vfs_dirent_get_name(struct retro_vfs_dir_handle *h) {
+	return h->ent ? h->ent->d_name : NULL;
+}
+
+static bool RETRO_CALLCONV vfs_dirent_is_dir(struct retro_vfs_dir_handle *h) {
+	if (!h->ent)
+		return false;
+	if (h->ent->d_type != DT_UNKNOWN)
+		return h->ent->d_type == DT_DIR;
+	std::string p = h->path + "/" + h->ent->d_name;
+	struct stat st;
+	return !stat(p.c_str(), &st) && S_ISDIR(st.st_mode);
+}
+
+static int RETRO_CALLCONV vfs_closedir(struct retro_vfs_dir_handle *h) {
+	int ret = closedir(h->dir);
+	delete h;
+	return ret < 0 ? -1 : 0;
+}
+
+static struct retro_vfs_interface vfs_iface = {
+	vfs_get_path, vfs_open, vfs_close, vfs_size, vfs_tell, vfs_seek,
+	vfs_read, vfs_write, vfs_flush, vfs_remove, vfs_rename,
+	vfs_truncate,
+	vfs_stat, vfs_mkdir, vfs_opendir, vfs_readdir, vfs_dirent_get_name,
+	vfs_dirent_is_dir, vfs_closedir,
+};
+
+bool vfs_get_interface(struct retro_vfs_interface_info *info) {
+	if (info->required_interface_version > VFS_VERSION)
+		return false;
+	info->required_interface_version = VFS_VERSION;
+	info->iface = &vfs_iface;
+	return true;
+}
+
+void vfs_report(std::ostream &os) {
+	std::lock_guard<std::mutex> g(vfs_mutex);
+	for (const auto &it : vfs_stats) {
+		const vfs_stats_t &s = it.second;
+		os << "VFS file " << it.first << (s.cached ? " (cached)" : "") << ": "
+		   << s.opens << " opens, " << s.reads << " reads (" << s.rdbytes << " bytes, "
+		   << s.smallreads << " smaller than " << VFS_SMALL_READ << " bytes), "
+		   << s.seeks << " seeks, " << s.writes << " writes (" << s.wrbytes << " bytes)"
+		   << std::endl;
+	}
+}
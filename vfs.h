@@ -0,0 +1,26 @@
+// Copyright 2021 David Guillen Fandos <david@davidgf.net>
+// Released under the GPL2 license
+
+#ifndef _VFS_H__
+#define _VFS_H__
+
+#include <string>
+#include <ostream>
+#include "libretro.h"
+
+// Frontend side of the libretro VFS interface (GET_VFS_INTERFACE, up to v3).
+// Read-only files are served from mmap'ed views. Files under the system
+// directory (BIOS and friends) stay mapped until vfs_deinit() so that cores
+// re-opening them don't hit the filesystem again. Every file opened through
+// the interface gets read/seek/write statistics.
+
+void vfs_init(const std::string &sysdir);
+void vfs_deinit();
+
+// Fills the interface, returns false if the core wants a newer version.
+bool vfs_get_interface(struct retro_vfs_interface_info *info);
+
+// Prints per-file access statistics (only files opened via VFS).
+void vfs_report(std::ostream &os);
+
+#endif
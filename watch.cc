@@ -0,0 +1,121 @@
+// Copyright 2021 David Guillen Fandos <david@davidgf.net>
+// Released under the GPL2 license
+
+#include <stdlib.h>
+#include <string.h>
+#include "watch.h"
+
+enum { OP_EQ, OP_NE, OP_LT, OP_GT, OP_LE, OP_GE, OP_CHANGE };
+
+// Longest operators first so that "<=" is not taken for "<"
+static const struct { const char *str; unsigned op; } ops[] = {
+	{"==", OP_EQ}, {"!=", OP_NE}, {"<=", OP_LE}, {">=", OP_GE},
+	{"<", OP_LT}, {">", OP_GT}, {"~", OP_CHANGE},
+};
+
+static bool parse_num(const std::string &s, uint64_t *v) {
+	if (s.empty())
+		return false;
+	char *end;
+	*v = strtoull(s.c_str(), &end, 0);
+	return !*end;
+}
+
+bool watch_parse(const std::string &expr, mem_watch_t *w) {
+	w->expr = expr;
+	w->primed = false;
+	w->prevres = false;
+	w->prevval = 0;
+
+	auto p1 = expr.find(':'), p2 = expr.rfind(':');
+	if (p1 == std::string::npos || p1 == p2)
+		return false;
+	std::string region = expr.substr(0, p1);
+	std::string cond = expr.substr(p1 + 1, p2 - p1 - 1);
+	std::string action = expr.substr(p2 + 1);
+
+	if (region == "ram")
+		w->region = RETRO_MEMORY_SYSTEM_RAM;
+	else if (region == "save")
+		w->region = RETRO_MEMORY_SAVE_RAM;
+	else if (region == "vram")
+		w->region = RETRO_MEMORY_VIDEO_RAM;
+	else
+		return false;
+
+	if (action == "stop")
+		w->action = WATCH_STOP;
+	else if (action == "screenshot")
+		w->action = WATCH_SCREENSHOT;
+	else if (action == "savestate")
+		w->action = WATCH_SAVESTATE;
+	else
+		return false;
+
+	size_t opos = std::string::npos, oplen = 0;
+	for (const auto &o : ops) {
+		opos = cond.find(o.str);
+		if (opos != std::string::npos) {
+			w->op = o.op;
+			oplen = strlen(o.str);
+			break;
+		}
+	}
+	if (opos == std::string::npos)
+		return false;
+	std::string addr = cond.substr(0, opos);
+	std::string value = cond.substr(opos + oplen);
+
+	w->width = 1;
+	auto dot = addr.find('.');
+	if (dot != std::string::npos) {
+		w->width = atoi(addr.substr(dot + 1).c_str());
+		addr = addr.substr(0, dot);
+		if (w->width != 1 && w->width != 2 && w->width != 4)
+			return false;
+	}
+	uint64_t a;
+	if (!parse_num(addr, &a))
+		return false;
+	w->addr = a;
+
+	w->value = 0;
+	if (w->op == OP_CHANGE)
+		return value.empty();
+	return parse_num(value, &w->value);
+}
+
+unsigned watch_eval(std::vector<mem_watch_t> &watches, const core_functions_t *core,
+                    const memory_map_t *mm, std::vector<const mem_watch_t*> *fired) {
+	unsigned actions = 0;
+	for (auto &w : watches) {
+		const uint8_t *p = memory_ptr(core, mm, w.region, w.addr, w.width);
+		if (!p)
+			continue;
+		uint64_t v = 0;
+		for (unsigned i = 0; i < w.width; i++)
+			v |= (uint64_t)p[i] << (i * 8);
+
+		bool res;
+		switch (w.op) {
+		case OP_EQ: res = (v == w.value); break;
+		case OP_NE: res = (v != w.value); break;
+		case OP_LT: res = (v <  w.value); break;
+		case OP_GT: res = (v >  w.value); break;
+		case OP_LE: res = (v <= w.value); break;
+		case OP_GE: res = (v >= w.value); break;
+		default:    res = w.primed && (v != w.prevval); break;
+		};
+
+		bool trigger = (w.op == OP_CHANGE) ? res : (res && !w.prevres);
+		w.primed = true;
+		w.prevres = res;
+		w.prevval = v;
+		if (trigger) {
+			actions |= w.action;
+			if (fired)
+				fired->push_back(&w);
+		}
+	}
+	return actions;
+}
@@ -0,0 +1,48 @@
+// Copyright 2021 David Guillen Fandos <david@davidgf.net>
+// Released under the GPL2 license
+
+#ifndef _WATCH_H__
+#define _WATCH_H__
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include "memmap.h"
+
+// Memory watches: conditions on core memory that trigger frontend actions.
+// Syntax is region:address[.width]<op>value:action, for instance
+//   ram:0x1c40==3:stop     ram:0x20.2>=1000:screenshot     save:0x10~:savestate
+// Regions are ram, save and vram; widths are 1, 2 or 4 bytes (little endian).
+// Addresses are offsets into the region, or emulated addresses for regions the
+// core only exposes through memory maps (see memory_ptr).
+// Operators are == != < > <= >= and ~ (value changed, takes no operand).
+// Comparisons trigger when they become true, changes on every change.
+
+enum {
+	WATCH_STOP       = 1,
+	WATCH_SCREENSHOT = 2,
+	WATCH_SAVESTATE  = 4,
+};
+
+typedef struct {
+	std::string expr;
+	unsigned region;       // RETRO_MEMORY_* id
+	size_t addr;
+	unsigned width;
+	unsigned op;
+	uint64_t value;
+	unsigned action;       // WATCH_* flag
+	bool primed;           // Holds a previous value/result
+	bool prevres;
+	uint64_t prevval;
+} mem_watch_t;
+
+// Parses a watch expression, returns false if it is malformed.
+bool watch_parse(const std::string &expr, mem_watch_t *w);
+
+// Evaluates all the watches against the current memory contents.
+// Returns the WATCH_* actions that fired (and their watches in "fired").
+unsigned watch_eval(std::vector<mem_watch_t> &watches, const core_functions_t *core,
+                    const memory_map_t *mm, std::vector<const mem_watch_t*> *fired);
+
+#endif